@@ -53,7 +53,6 @@ namespace rpi_rgb_led_matrix_sharp
                 opt.rows = options.Rows;
                 opt.cols = options.Cols;
                 opt.hardware_mapping = options.HardwareMapping != null ? Marshal.StringToHGlobalAnsi(options.HardwareMapping) : IntPtr.Zero;
-                opt.inverse_colors = (uint)(options.InverseColors ? 0 : 1);  
                 opt.led_rgb_sequence = options.LedRgbSequence != null ? Marshal.StringToHGlobalAnsi(options.LedRgbSequence) : IntPtr.Zero;
                 opt.pixel_mapper_config = options.PixelMapperConfig != null ? Marshal.StringToHGlobalAnsi(options.PixelMapperConfig) : IntPtr.Zero;
                 opt.parallel = options.Parallel;
@@ -62,11 +61,11 @@ namespace rpi_rgb_led_matrix_sharp
                 opt.pwm_lsb_nanoseconds = options.PwmLsbNanoseconds;
                 opt.pwm_dither_bits = options.PwmDitherBits;
                 opt.scan_mode = options.ScanMode;
-                opt.show_refresh_rate = (uint)(options.ShowRefreshRate ? 0 : 1);
                 opt.brightness = options.Brightness;
-                opt.disable_hardware_pulsing = (uint)(options.DisableHardwarePulsing ? 1 : 0);
+                opt.flags = (options.DisableHardwarePulsing ? 1u : 0u)
+                          | (options.ShowRefreshRate ? 2u : 0u)
+                          | (options.InverseColors ? 4u : 0u);
                 opt.row_address_type = options.RowAddressType;
-                opt.gpio_slowdown = options.GpioSlowdown;
                 // dont care about these
                 var argc = IntPtr.Zero;
                 var argv = IntPtr.Zero;
@@ -145,10 +144,12 @@ namespace rpi_rgb_led_matrix_sharp
             public int multiplexing;
             public IntPtr led_rgb_sequence;
             public IntPtr pixel_mapper_config; 
-            public uint disable_hardware_pulsing;
-            public uint show_refresh_rate;
-            public uint inverse_colors;
-            public int gpio_slowdown;
+            // The C bitfields share one unsigned: bit 0 disable_hardware_pulsing,
+            // bit 1 show_refresh_rate, bit 2 inverse_colors.
+            public uint flags;
+            public IntPtr gamma;
+            public IntPtr white_balance;
+            public int target_refresh;
         };
         #endregion
     }
@@ -17,6 +17,8 @@ cdef class RGBMatrixOptions:
     cdef bytes __py_encoded_hardware_mapping
     cdef bytes __py_encoded_led_rgb_sequence
     cdef bytes __py_encoded_pixel_mapper_config
+    cdef bytes __py_encoded_gamma
+    cdef bytes __py_encoded_white_balance
 
 
 # Local Variables:
@@ -1,7 +1,7 @@
 # distutils: language = c++
 
 from libcpp cimport bool
-from libc.stdint cimport uint8_t, uint32_t, uintptr_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t, uintptr_t
 from PIL import Image
 import cython
 
@@ -72,6 +72,21 @@ cdef class FrameCanvas(Canvas):
     def SetPixel(self, int x, int y, uint8_t red, uint8_t green, uint8_t blue):
         (<cppinc.FrameCanvas*>self.__getCanvas()).SetPixel(x, y, red, green, blue)
 
+    def SetGamma(self, float red, float green, float blue):
+        (<cppinc.FrameCanvas*>self.__getCanvas()).SetGamma(red, green, blue)
+
+    def SetWhiteBalance(self, float red, float green, float blue):
+        (<cppinc.FrameCanvas*>self.__getCanvas()).SetWhiteBalance(red, green, blue)
+
+    def BlitFrom(self, FrameCanvas src, int sx, int sy, int width, int height, int dx, int dy):
+        (<cppinc.FrameCanvas*>self.__getCanvas()).BlitFrom(
+            (<cppinc.FrameCanvas*>src.__getCanvas())[0], sx, sy, width, height, dx, dy)
+
+    def GetPixel(self, int x, int y):
+        cdef uint8_t red, green, blue
+        (<cppinc.FrameCanvas*>self.__getCanvas()).GetPixel(x, y, &red, &green, &blue)
+        return (red, green, blue)
+
 
     property width:
         def __get__(self): return (<cppinc.FrameCanvas*>self.__getCanvas()).width()
@@ -87,6 +102,10 @@ cdef class FrameCanvas(Canvas):
         def __get__(self): return (<cppinc.FrameCanvas*>self.__getCanvas()).brightness()
         def __set__(self, val): (<cppinc.FrameCanvas*>self.__getCanvas()).SetBrightness(val)
 
+    property scrollOffset:
+        def __get__(self): return (<cppinc.FrameCanvas*>self.__getCanvas()).scroll_offset()
+        def __set__(self, val): (<cppinc.FrameCanvas*>self.__getCanvas()).SetScrollOffset(val)
+
 
 cdef class RGBMatrixOptions:
     def __cinit__(self):
@@ -152,6 +171,26 @@ cdef class RGBMatrixOptions:
         def __get__(self): return self.__options.inverse_colors
         def __set__(self, value): self.__options.inverse_colors = value
 
+    property limit_pwm_storage:
+        def __get__(self): return self.__options.limit_pwm_storage
+        def __set__(self, value): self.__options.limit_pwm_storage = value
+
+    property packed_bitplanes:
+        def __get__(self): return self.__options.packed_bitplanes
+        def __set__(self, value): self.__options.packed_bitplanes = value
+
+    property hardware_brightness:
+        def __get__(self): return self.__options.hardware_brightness
+        def __set__(self, value): self.__options.hardware_brightness = value
+
+    property skip_blank_planes:
+        def __get__(self): return self.__options.skip_blank_planes
+        def __set__(self, value): self.__options.skip_blank_planes = value
+
+    property precompile_scanout:
+        def __get__(self): return self.__options.precompile_scanout
+        def __set__(self, value): self.__options.precompile_scanout = value
+
     property led_rgb_sequence:
         def __get__(self): return self.__options.led_rgb_sequence
         def __set__(self, value):
@@ -164,10 +203,26 @@ cdef class RGBMatrixOptions:
             self.__py_encoded_pixel_mapper_config = value.encode('utf-8')
             self.__options.pixel_mapper_config = self.__py_encoded_pixel_mapper_config
 
+    property gamma:
+        def __get__(self): return self.__options.gamma
+        def __set__(self, value):
+            self.__py_encoded_gamma = value.encode('utf-8')
+            self.__options.gamma = self.__py_encoded_gamma
+
+    property white_balance:
+        def __get__(self): return self.__options.white_balance
+        def __set__(self, value):
+            self.__py_encoded_white_balance = value.encode('utf-8')
+            self.__options.white_balance = self.__py_encoded_white_balance
+
     property pwm_dither_bits:
         def __get__(self): return self.__options.pwm_dither_bits
         def __set__(self, uint8_t value): self.__options.pwm_dither_bits = value
 
+    property target_refresh:
+        def __get__(self): return self.__options.target_refresh
+        def __set__(self, int value): self.__options.target_refresh = value
+
 
     # RuntimeOptions properties
 
@@ -220,12 +275,66 @@ cdef class RGBMatrix(Canvas):
     def Clear(self):
         self.__matrix.Clear()
 
+    def SetGamma(self, float red, float green, float blue):
+        self.__matrix.SetGamma(red, green, blue)
+
+    def SetWhiteBalance(self, float red, float green, float blue):
+        self.__matrix.SetWhiteBalance(red, green, blue)
+
     def CreateFrameCanvas(self):
         return __createFrameCanvas(self.__matrix.CreateFrameCanvas())
 
+    # Returns None if the width is too small or not supported.
+    def CreateScrollCanvas(self, int width):
+        cdef cppinc.FrameCanvas *canvas = self.__matrix.CreateScrollCanvas(width)
+        if canvas == NULL:
+            return None
+        return __createFrameCanvas(canvas)
+
     def SwapOnVSync(self, FrameCanvas newFrame):
         return __createFrameCanvas(self.__matrix.SwapOnVSync(newFrame.__canvas))
 
+    def PanOnVSync(self, int column, unsigned framerate_fraction = 1):
+        with nogil:
+            self.__matrix.PanOnVSync(column, framerate_fraction)
+
+    def SubmitFrame(self, FrameCanvas newFrame):
+        return __createFrameCanvas(self.__matrix.SubmitFrame(newFrame.__canvas))
+
+    # present_at_us is time.monotonic() in microseconds.
+    def QueueFrame(self, FrameCanvas frame, uint64_t present_at_us):
+        return self.__matrix.QueueFrame(frame.__canvas, present_at_us)
+
+    # Returns (canvas, presented_at_us) or None on timeout.
+    def AwaitReleasedFrame(self, int timeout_ms = -1):
+        cdef uint64_t presented_at_us = 0
+        cdef cppinc.FrameCanvas *released
+        with nogil:
+            released = self.__matrix.AwaitReleasedFrame(timeout_ms,
+                                                        &presented_at_us)
+        if released == NULL:
+            return None
+        return (__createFrameCanvas(released), presented_at_us)
+
+    def GetRefreshStats(self):
+        cdef cppinc.RefreshStats stats
+        if not self.__matrix.GetRefreshStats(&stats):
+            return None
+        return {
+            'frames': stats.frames,
+            'last_frame_us': stats.last_frame_us,
+            'max_frame_us': stats.max_frame_us,
+            'total_frame_us': stats.total_frame_us,
+            'frame_time_histogram': [stats.frame_time_histogram[i] for i in range(16)],
+            'swaps': stats.swaps,
+            'total_swap_wait_us': stats.total_swap_wait_us,
+            'max_swap_wait_us': stats.max_swap_wait_us,
+            'missed_swaps': stats.missed_swaps,
+            'dropped_frames': stats.dropped_frames,
+            'pwm_bits': stats.pwm_bits,
+            'pwm_dither_bits': stats.pwm_dither_bits,
+        }
+
     property luminanceCorrect:
         def __get__(self): return self.__matrix.luminance_correct()
         def __set__(self, luminanceCorrect): self.__matrix.set_luminance_correct(luminanceCorrect)
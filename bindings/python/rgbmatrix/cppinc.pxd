@@ -1,5 +1,5 @@
 from libcpp cimport bool
-from libc.stdint cimport uint8_t, uint32_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
 
 ########################
 ### External classes ###
@@ -21,14 +21,28 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix":
         bool luminance_correct()
         void SetBrightness(uint8_t)
         uint8_t brightness()
+        void SetGamma(float, float, float)
+        void SetWhiteBalance(float, float, float)
         FrameCanvas *CreateFrameCanvas()
+        FrameCanvas *CreateScrollCanvas(int)
         FrameCanvas *SwapOnVSync(FrameCanvas*)
+        void PanOnVSync(int, unsigned) nogil
+        FrameCanvas *SubmitFrame(FrameCanvas*)
+        bool QueueFrame(FrameCanvas*, uint64_t)
+        FrameCanvas *AwaitReleasedFrame(int, uint64_t*) nogil
+        bool GetRefreshStats(RefreshStats*)
 
     cdef cppclass FrameCanvas(Canvas):
         bool SetPWMBits(uint8_t)
         uint8_t pwmbits()
         void SetBrightness(uint8_t)
         uint8_t brightness()
+        void SetGamma(float, float, float)
+        void SetWhiteBalance(float, float, float)
+        void SetScrollOffset(int)
+        int scroll_offset()
+        void BlitFrom(FrameCanvas&, int, int, int, int, int, int)
+        void GetPixel(int, int, uint8_t*, uint8_t*, uint8_t*)
 
     struct RuntimeOptions:
       RuntimeOptions() except +
@@ -58,13 +72,37 @@ cdef extern from "led-matrix.h" namespace "rgb_matrix::RGBMatrix":
         int row_address_type
         int multiplexing
         int pwm_dither_bits
+        int target_refresh
 
         bool disable_hardware_pulsing
         bool show_refresh_rate
         bool inverse_colors
+        bool limit_pwm_storage
+        bool packed_bitplanes
+        bool hardware_brightness
+        bool skip_blank_planes
+        bool precompile_scanout
 
         const char *led_rgb_sequence
         const char *pixel_mapper_config
+        const char *gamma
+        const char *white_balance
+
+    cdef struct RefreshStats:
+        RefreshStats() except +
+
+        uint64_t frames
+        uint32_t last_frame_us
+        uint32_t max_frame_us
+        uint64_t total_frame_us
+        uint64_t frame_time_histogram[16]
+        uint64_t swaps
+        uint64_t total_swap_wait_us
+        uint32_t max_swap_wait_us
+        uint64_t missed_swaps
+        uint64_t dropped_frames
+        int pwm_bits
+        int pwm_dither_bits
 
 cdef extern from "graphics.h" namespace "rgb_matrix":
     cdef struct Color:
@@ -6,7 +6,9 @@
 // the Pi to avoid stuttering or brightness glitches.
 //
 // The disadvantage is, that this represents the full expanded internal
-// representation of a frame, so is very large memory wise.
+// representation of a frame, so is very large memory wise. To mitigate that
+// a bit, only the rows that changed compared to the previous frame are
+// written to the stream.
 //
 // These abstractions are used in util/led-image-viewer.cc to read and
 // write such animations to disk. It is also used in util/video-viewer.cc
@@ -15,6 +17,8 @@
 #include <stdlib.h>
 
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace rgb_matrix {
 class FrameCanvas;
@@ -73,6 +77,8 @@ private:
 
   StreamIO *const io_;
   bool header_written_;
+  // Of the previously streamed frame, see Framebuffer::row_version().
+  std::vector<std::pair<uint64_t, uint64_t> > row_versions_;
 };
 
 class StreamReader {
@@ -98,8 +104,10 @@ private:
 
   StreamIO *io_;
   size_t buf_size_;
+  int double_rows_;
   State state_;
 
-  char *buffer_;
+  char *buffer_;  // Always the full current frame; updated by delta frames.
+  bool have_frame_;
 };
 }
@@ -20,9 +20,35 @@
 
 #include <vector>
 
+#include "thread.h"
+
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+// A GPIOBackend receives all GPIO operations instead of the Raspberry Pi
+// hardware registers. Useful to run, benchmark and verify the refresh on
+// machines without GPIO.
+class GPIOBackend {
+public:
+  virtual ~GPIOBackend() {}
+
+  // Set or clear the bits that are '1' in "value".
+  virtual void SetBits(uint32_t value) = 0;
+  virtual void ClearBits(uint32_t value) = 0;
+
+  // Return current input bits.
+  virtual uint32_t Read() = 0;
+
+  // Clear the "bits" for "nanoseconds", then set them again. This is how
+  // the output enable is pulsed.
+  virtual void Pulse(uint32_t bits, long nanoseconds) = 0;
+
+  // Stay dark for "nanoseconds" after a pulse that was shortened with
+  // PinPulser::SetPulseScale(), so that the bit-plane keeps its unscaled
+  // time. Backends that don't model timing can ignore it.
+  virtual void Wait(long nanoseconds) {}
+};
+
 // For now, everything is initialized as output.
 class GPIO {
  public:
@@ -41,6 +67,11 @@ class GPIO {
 #endif
             );
 
+  // Initialize to send all operations to the given backend instead of the
+  // hardware. The backend is not owned and needs to outlive this GPIO.
+  bool Init(GPIOBackend *backend);
+  GPIOBackend *backend() const { return backend_; }
+
   // Initialize outputs.
   // Returns the bits that were available and could be set for output.
   // (never use the optional adafruit_hack_needed parameter, it is used
@@ -54,6 +85,7 @@ class GPIO {
   // Set the bits that are '1' in the output. Leave the rest untouched.
   inline void SetBits(uint32_t value) {
     if (!value) return;
+    if (backend_) { backend_->SetBits(value); return; }
     *gpio_set_bits_ = value;
     for (int i = 0; i < slowdown_; ++i) {
       *gpio_set_bits_ = value;
@@ -63,6 +95,7 @@ class GPIO {
   // Clear the bits that are '1' in the output. Leave the rest untouched.
   inline void ClearBits(uint32_t value) {
     if (!value) return;
+    if (backend_) { backend_->ClearBits(value); return; }
     *gpio_clr_bits_ = value;
     for (int i = 0; i < slowdown_; ++i) {
       *gpio_clr_bits_ = value;
@@ -78,9 +111,13 @@ class GPIO {
   }
 
   inline void Write(uint32_t value) { WriteMaskedBits(value, output_bits_); }
-  inline uint32_t Read() const { return *gpio_read_bits_ & input_bits_; }
+  inline uint32_t Read() const {
+    if (backend_) return backend_->Read() & input_bits_;
+    return *gpio_read_bits_ & input_bits_;
+  }
 
  private:
+  GPIOBackend *backend_;
   uint32_t output_bits_;
   uint32_t input_bits_;
   uint32_t reserved_bits_;
@@ -109,8 +146,69 @@ public:
   // Send a pulse with a given length (index into nano_wait_spec array).
   virtual void SendPulse(int time_spec_number) = 0;
 
+  // Keep the output dark for the unscaled length of a pulse, e.g. instead of
+  // a bit-plane without any LED on, so that the timing stays the same.
+  // Waits for a pending pulse first; like SendPulse(), it may return before
+  // the time is over. Pulsers that don't support this don't wait at all.
+  virtual void SendDarkPulse(int time_spec_number) {}
+
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Scale all pulses to the given percent (1..100) of the lengths in the
+  // nano_wait_spec. Waits for a pending pulse to finish first.
+  // Pulsers that don't support this keep the full length.
+  virtual void SetPulseScale(int percent) {}
+};
+
+// A GPIOBackend that records the sequence of all operations in memory, e.g.
+// to inspect or decode the signals DumpToMatrix() generates.
+//
+// Like with the real GPIO, operations come from one thread at a time. They
+// are buffered without locking and handed over at each pulse, so events can
+// be taken while the matrix refresh thread is running; the refresh only
+// takes a lock once per bit-plane.
+class RecordingGPIOBackend : public GPIOBackend {
+public:
+  struct Event {
+    enum Type { SET, CLEAR, PULSE, WAIT };
+    Type type;
+    uint32_t bits;         // 0 for WAIT.
+    uint32_t nanoseconds;  // Pulse or wait length; 0 for SET and CLEAR.
+  };
+
+  // Records up to "max_events"; further events are counted as dropped
+  // until the recorded ones are taken out.
+  explicit RecordingGPIOBackend(size_t max_events = (1 << 22));
+
+  // Swap out recorded events into "events" and start a new recording.
+  // Events after the last pulse or wait are not handed over yet.
+  // Returns the number of events dropped since the last call.
+  size_t TakeEvents(std::vector<Event> *events);
+
+  // The value returned by Read().
+  void SetInputs(uint32_t inputs);
+
+  virtual void SetBits(uint32_t value);
+  virtual void ClearBits(uint32_t value);
+  virtual uint32_t Read();
+  virtual void Pulse(uint32_t bits, long nanoseconds);
+  virtual void Wait(long nanoseconds);
+
+private:
+  void Record(Event::Type type, uint32_t bits, uint32_t nanoseconds);
+  void HandOver();  // Move pending events to the ones TakeEvents() gets.
+
+  const size_t max_events_;
+
+  // Only accessed by the thread doing the GPIO operations.
+  std::vector<Event> pending_;
+  size_t pending_dropped_;
+
+  Mutex mutex_;
+  std::vector<Event> events_;
+  size_t dropped_;
+  uint32_t inputs_;
 };
 
 // Get rolling over microsecond counter. We get this from a hardware register
@@ -141,6 +141,81 @@ struct RGBLedMatrixOptions {
   unsigned show_refresh_rate:1;  /* Corresponding flag: --led-show-refresh    */
   // unsigned swap_green_blue:1; /* deprecated, use led_sequence instead */
   unsigned inverse_colors:1;     /* Corresponding flag: --led-inverse         */
+
+  /* Only allocate memory for pwm_bits bitplanes. Saves memory with low
+   * pwm_bits, but they can't be raised above the initial value later.
+   */
+  unsigned limit_pwm_storage:1;  /* Corresponding flag: --led-limit-pwm-storage */
+
+  /* Store the frame-buffer in a compact representation with only the color
+   * bits, that is expanded while sending to the panels. Saves memory.
+   */
+  unsigned packed_bitplanes:1;   /* Corresponding flag: --led-packed-bitplanes */
+
+  /* Apply brightness by changing the output timing instead of the colors;
+   * brightness changes are then visible immediately without re-drawing.
+   * Implies disable_hardware_pulsing.
+   */
+  unsigned hardware_brightness:1; /* Corresponding flag: --led-hardware-brightness */
+
+  /* Don't clock in bitplanes of a row in which all LEDs are off; the row
+   * just stays dark for the time of such a bitplane. Frame timing and
+   * brightness stay the same, sparse content needs less CPU.
+   */
+  unsigned skip_blank_planes:1;  /* Corresponding flag: --led-skip-blank-planes */
+
+  /* Precompute the GPIO output of frames when they are handed over, so that
+   * the refresh thread only needs to stream it out. Uses more memory.
+   */
+  unsigned precompile_scanout:1; /* Corresponding flag: --led-precompile-scanout */
+
+  /** Newer fields are appended at the end to keep the layout above **/
+
+  /* Per channel gamma (0 = CIE1931) and white balance (0..1). Either one
+   * value for all channels or three comma separated for red, green, blue.
+   */
+  const char *gamma;                /* Corresponding flag: --led-gamma */
+  const char *white_balance;        /* Corresponding flag: --led-white-balance */
+
+  /* Refresh rate in Hz to keep up by lowering pwm bits and dithering while
+   * running; 0 = off.
+   * Corresponding flag: --led-target-refresh
+   */
+  int target_refresh;
+};
+
+/**
+ * Statistics of the refresh thread, see led_matrix_get_refresh_stats().
+ * All times are in microseconds, all counts since the refresh started.
+ */
+struct LedRefreshStats {
+  uint64_t frames;             /* Number of frames shown. */
+  uint32_t last_frame_us;      /* Time of the most recent frame. */
+  uint32_t max_frame_us;       /* Longest frame, ignoring start-up. */
+  uint64_t total_frame_us;     /* Sum of all frame times. */
+
+  /* frame_time_histogram[i] counts frames taking 2^(i+6)..2^(i+7)-1 usec;
+   * the first and last bucket also count all shorter or longer frames.
+   */
+  uint64_t frame_time_histogram[16];
+
+  uint64_t swaps;              /* Completed led_matrix_swap_on_vsync() calls */
+  uint64_t total_swap_wait_us; /* Time spent waiting in these. */
+  uint32_t max_swap_wait_us;
+
+  /* Frames shown again between two swaps because the next swap came in too
+   * late for its vsync. Only meaningful when swapping continuously.
+   */
+  uint64_t missed_swaps;
+
+  /* Frames given to led_matrix_submit_frame() that were replaced by a newer
+   * one before they were shown.
+   */
+  uint64_t dropped_frames;
+
+  /* pwm bits and dither bits currently shown, see target_refresh. */
+  int pwm_bits;
+  int pwm_dither_bits;
 };
 
 /**
@@ -224,12 +299,28 @@ void led_canvas_get_size(const struct LedCanvas *canvas,
 void led_canvas_set_pixel(struct LedCanvas *canvas, int x, int y,
 			  uint8_t r, uint8_t g, uint8_t b);
 
+/**
+ * Get the color of the pixel at (x, y), reconstructed with the current
+ * brightness and color settings; approximate for dark colors. Black if
+ * outside the canvas.
+ */
+void led_canvas_get_pixel(const struct LedCanvas *canvas, int x, int y,
+                          uint8_t *r, uint8_t *g, uint8_t *b);
+
 /** Clear screen (black). */
 void led_canvas_clear(struct LedCanvas *canvas);
 
 /** Fill matrix with given color. */
 void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b);
 
+/**
+ * Copy the "width" x "height" pixels at "sx","sy" of canvas "src" to
+ * "dx","dy" of "dst" as they are stored, without converting colors again.
+ * Both canvases need to belong to the same matrix; they may be the same.
+ */
+void led_canvas_blit(struct LedCanvas *dst, const struct LedCanvas *src,
+                     int sx, int sy, int width, int height, int dx, int dy);
+
 /*** API to provide double-buffering. ***/
 
 /**
@@ -238,6 +329,31 @@ void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b);
  */
 struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix);
 
+/**
+ * Create a canvas "width" columns wide for scrolling, e.g. for a ticker: the
+ * panels show the columns from the scroll offset on, wrapping around at the
+ * end (see led_canvas_set_scroll_offset()). Uses the plain layout of the
+ * chain without pixel mappers. Returns NULL if narrower than the chain or
+ * with multiplexing panels. Ownership stays with the matrix.
+ */
+struct LedCanvas *led_matrix_create_scroll_canvas(struct RGBLedMatrix *matrix,
+                                                  int width);
+
+/**
+ * Show the canvas columns from "column" on, wrapping around at its width.
+ * Takes effect with the next refresh, also on the canvas currently shown.
+ * Does nothing unless it is a scroll canvas wider than the panels.
+ */
+void led_canvas_set_scroll_offset(struct LedCanvas *canvas, int column);
+
+/**
+ * Wait for the next vsync and move the viewport of the canvas shown from
+ * then on to "column", like led_canvas_set_scroll_offset(). Locked to the
+ * refresh, for smooth panning over a wide scroll canvas; other canvases
+ * are left as they are.
+ */
+void led_matrix_pan_on_vsync(struct RGBLedMatrix *matrix, int column);
+
 /**
  * Swap the given canvas (created with create_offscreen_canvas) with the
  * currently active canvas on vsync (blocks until vsync is reached).
@@ -253,9 +369,52 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *matrix
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas);
 
+/**
+ * Non-blocking alternative to led_matrix_swap_on_vsync() for programs that
+ * render at their own pace: the given canvas is shown from the next refresh
+ * on (if no newer one is submitted until then). Returns right away with a
+ * canvas that is not shown to draw the next frame into; it has old content.
+ * Submitting NULL, or without a running refresh thread, does nothing and
+ * returns NULL.
+ * Don't mix with led_matrix_swap_on_vsync().
+ */
+struct LedCanvas *led_matrix_submit_frame(struct RGBLedMatrix *matrix,
+                                          struct LedCanvas *canvas);
+
+/**
+ * Timed presentation for animations: queue the canvas to be shown from the
+ * first refresh at or after "present_at_us" (CLOCK_MONOTONIC microseconds).
+ * Returns 0 if the refresh is not running.
+ */
+int led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                           struct LedCanvas *canvas, uint64_t present_at_us);
+
+/**
+ * Get back a queued canvas that was replaced on screen or skipped. Waits up
+ * to timeout_ms (forever if negative), returns NULL on timeout. If
+ * presented_at_us is not NULL, it is set to the time the canvas was shown
+ * first, 0 if it was skipped.
+ */
+struct LedCanvas *led_matrix_await_released_frame(struct RGBLedMatrix *matrix,
+                                                  int timeout_ms,
+                                                  uint64_t *presented_at_us);
+
 uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix);
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix, uint8_t brightness);
 
+/* Per channel gamma (0 = CIE1931) and white balance (0..1) */
+void led_matrix_set_gamma(struct RGBLedMatrix *matrix,
+                          float red, float green, float blue);
+void led_matrix_set_white_balance(struct RGBLedMatrix *matrix,
+                                  float red, float green, float blue);
+
+/* Fill "stats" with a snapshot of the refresh statistics. Cheap enough to be
+ * polled for monitoring. Returns 0 (and leaves "stats" untouched) if the
+ * refresh thread is not running, 1 otherwise.
+ */
+int led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                 struct LedRefreshStats *stats);
+
 struct LedFont *load_font(const char *bdf_font_file);
 void delete_font(struct LedFont *font);
 
@@ -38,6 +38,34 @@ class Framebuffer;
 class PixelDesignatorMap;
 }
 
+// Time the refresh spends in the phases of sending a frame to the panels,
+// per double row and bit-plane. See RGBMatrix::EnableRefreshTiming().
+struct RefreshTiming {
+  RefreshTiming();
+
+  enum Phase {
+    CLOCK_IN,      // Clocking the color data of the bit-plane into the panels.
+    WAIT_PULSE,    // Waiting for the output-enable pulse of the previous plane.
+    ROW_SELECT,    // Setting the row address and strobing the data in.
+    NUM_PHASES
+  };
+  // With ONLY_SINGLE_SUB_PANEL, all 64 rows of a panel are double rows.
+  static const int kMaxDoubleRows = 64;
+  static const int kBitPlanes = 11;
+
+  uint64_t frames;     // Number of frames measured.
+  int double_rows;     // Rows used in the arrays below.
+
+  // Sum of nanoseconds of each phase and number of times the plane was sent.
+  // Planes are not sent if pwm bits are lowered, dithering sends the
+  // lowest ones only in some frames.
+  uint64_t nanoseconds[kMaxDoubleRows][kBitPlanes][NUM_PHASES];
+  uint32_t samples[kMaxDoubleRows][kBitPlanes];
+
+  // Nanoseconds summed up over all rows and planes.
+  uint64_t PhaseTotal(Phase phase) const;
+};
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 //
@@ -107,11 +135,31 @@ public:
     // Flag: --led-pwm-dither-bits
     int pwm_dither_bits;
 
+    // If non-zero, the refresh rate in Hz to keep up. The refresh measures
+    // its frame times and shows the most pwm bits with the least dithering
+    // that still reach this rate, adapting while running. pwm_bits is then
+    // the maximum shown, pwm_dither_bits is chosen automatically.
+    // Flag: --led-target-refresh
+    int target_refresh;
+
     // The initial brightness of the panel in percent. Valid range is 1..100
     // Default: 100
     // Flag: --led-brightness
     int brightness;
 
+    // Per channel correction, applied while building the color lookup
+    // tables, so it does not cost anything per pixel. Each is either a single
+    // value for all channels or comma separated values for red, green, blue.
+    //
+    // Gamma of the luminance curve; 0 (default) is the CIE1931 profile.
+    // Only used with luminance correction. Range 0..5, e.g. "2.2,2.0,2.4".
+    // Flag: --led-gamma
+    const char *gamma;
+    // Scale of the luminance per channel to correct the white point of
+    // panels that are too blue-ish or similar. Range 0..1, e.g. "1,0.9,0.8".
+    // Flag: --led-white-balance
+    const char *white_balance;
+
     // Scan mode: 0=progressive, 1=interlaced
     // Flag: --led-scan-mode
     int scan_mode;
@@ -136,6 +184,45 @@ public:
     // bool swap_green_blue; (Deprecated: use led_sequence instead)
     bool inverse_colors;       // Flag: --led-inverse
 
+    // Only allocate memory for pwm_bits bitplanes instead of the maximum of
+    // 11. With low pwm_bits, this saves a lot of memory and cache footprint
+    // (in particular with many FrameCanvases), but the pwm bits then can't
+    // be raised above the initial value later.
+    // Flag: --led-limit-pwm-storage
+    bool limit_pwm_storage;
+
+    // Store the frame-buffer in a packed representation, containing only the
+    // color bits (one byte per column and parallel chain in each bitplane)
+    // instead of full 32 bit GPIO words. These are expanded while sending
+    // to the panels. Makes each FrameCanvas 4x smaller with one parallel
+    // chain (2x with two), at the expense of some CPU in the refresh thread.
+    // Flag: --led-packed-bitplanes
+    bool packed_bitplanes;
+
+    // Apply the brightness by shortening the output-enable pulses instead of
+    // scaling the colors in the frame-buffers. Then SetBrightness() takes
+    // effect with the next refresh without re-drawing anything and keeps the
+    // full color depth; low percentages are limited by the timing resolution.
+    // The output-enable pulses are then timed by the CPU, not by the hardware
+    // pulse generator, as if --led-no-hardware-pulse was given.
+    // Flag: --led-hardware-brightness
+    bool hardware_brightness;
+
+    // Don't clock in bitplanes of a row in which all LEDs are off; the row
+    // just stays dark for the time of such a bitplane. Frame timing and
+    // brightness stay the same, sparse content needs less CPU and GPIO
+    // operations. No effect with inverse_colors.
+    // Flag: --led-skip-blank-planes
+    bool skip_blank_planes;
+
+    // Precompute the GPIO words to send for frames handed over with
+    // SwapOnVSync(), SubmitFrame() or QueueFrame(), in the calling thread.
+    // The refresh thread then only streams them out. Only rows changed
+    // since the frame was last handed over are computed again. Needs
+    // memory for two GPIO words per pixel column and bitplane.
+    // Flag: --led-precompile-scanout
+    bool precompile_scanout;
+
     // In case the internal sequence of mapping is not "RGB", this contains the
     // real mapping. Some panels mix up these colors.
     const char *led_rgb_sequence;  // Flag: --led-rgb-sequence
@@ -146,6 +233,41 @@ public:
     const char *pixel_mapper_config;   // Flag: --led-pixel-mapper
   };
 
+  // Statistics of the refresh thread, see GetRefreshStats(). All times are
+  // in microseconds, all counts since the refresh started.
+  struct RefreshStats {
+    RefreshStats();
+
+    // Frame times are collected in buckets of powers of two:
+    // frame_time_histogram[i] counts frames taking 2^(i+6)..2^(i+7)-1 usec;
+    // the first and last bucket also count all shorter or longer frames.
+    static const int kHistogramBuckets = 16;
+
+    uint64_t frames;             // Number of frames shown.
+    uint32_t last_frame_us;      // Time of the most recent frame.
+    uint32_t max_frame_us;       // Longest frame, ignoring start-up.
+    uint64_t total_frame_us;     // Sum of all frame times.
+    uint64_t frame_time_histogram[kHistogramBuckets];
+
+    uint64_t swaps;              // Number of completed SwapOnVSync() calls.
+    uint64_t total_swap_wait_us; // Time spent waiting in SwapOnVSync().
+    uint32_t max_swap_wait_us;
+
+    // Frames that were shown again between two SwapOnVSync() calls because
+    // the next call came in too late for its vsync. Only meaningful if
+    // SwapOnVSync() is called continuously, e.g. for an animation.
+    uint64_t missed_swaps;
+
+    // Frames given to SubmitFrame() that were replaced by a newer one before
+    // the refresh got to show them.
+    uint64_t dropped_frames;
+
+    // The pwm bits and dither bits currently shown. These are lowered from
+    // the configured ones with Options::target_refresh.
+    int pwm_bits;
+    int pwm_dither_bits;
+  };
+
   // Create an RGBMatrix.
   //
   // Needs an initialized GPIO object and configuration options from the
@@ -214,7 +336,8 @@ public:
   // Returns boolean to signify if value was within range.
   //
   // This sets the PWM bits for the current active FrameCanvas and future
-  // ones that are created with CreateFrameCanvas().
+  // ones that are created with CreateFrameCanvas(). With
+  // Options::target_refresh, the refresh tunes down from the new value.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();   // return the pwm-bits of the currently active buffer.
 
@@ -223,10 +346,18 @@ public:
   bool luminance_correct() const;
 
   // Set brightness in percent for all created FrameCanvas. 1%..100%.
-  // This will only affect newly set pixels.
+  // This will only affect newly set pixels, unless
+  // Options::hardware_brightness is set: then it changes the output timing
+  // and is visible with the next refresh.
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Set the per channel gamma (0 = CIE1931) and white balance (0..1) for
+  // all created FrameCanvas. See Options::gamma and Options::white_balance.
+  // This will only affect newly set pixels.
+  void SetGamma(float red, float green, float blue);
+  void SetWhiteBalance(float red, float green, float blue);
+
   //-- GPIO interaction
 
   // Return pointer to GPIO object for your own interaction with free
@@ -269,6 +400,18 @@ public:
   // don't have to worry about deleting them.
   FrameCanvas *CreateFrameCanvas();
 
+  // Create a FrameCanvas for scrolling, e.g. for a ticker: it is "width"
+  // columns wide, of which the panels show as many as they have, starting
+  // at its scroll offset and wrapping around at the end (see
+  // FrameCanvas::SetScrollOffset() and PanOnVSync()). So a ticker only
+  // needs to draw each new column once into the part not shown, and move
+  // the offset.
+  //
+  // The canvas uses the plain layout of the chain, no pixel mappers are
+  // applied. Returns NULL if "width" is less than the chain is wide or
+  // with multiplexing panels, where columns are not in order.
+  FrameCanvas *CreateScrollCanvas(int width);
+
   // This method waits to the next VSync and swaps the active buffer with the
   // supplied buffer. The formerly active buffer is returned.
   //
@@ -285,6 +428,66 @@ public:
   // 28Hz animation, nicely locked to the frame-rate).
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction = 1);
 
+  // Wait for the next VSync and move the viewport of the canvas shown from
+  // then on to "column", see FrameCanvas::SetScrollOffset(). With a canvas
+  // from CreateScrollCanvas() several times as wide as the panels, panning
+  // and slideshows only need to move the viewport, locked to the refresh
+  // like SwapOnVSync() ("framerate_fraction" is the same as there).
+  // If the canvas shown is not a scroll canvas wider than the panels, this
+  // only waits for the vsync and leaves the display as it is.
+  void PanOnVSync(int column, unsigned framerate_fraction = 1);
+
+  // Triple-buffering for programs that render at their own pace instead of
+  // the refresh rate: hands "other" over to be shown from the next refresh
+  // on and returns right away with a FrameCanvas that is neither shown nor
+  // waiting to be shown to draw the next frame into. If frames are submitted
+  // faster than they are shown, only the newest is shown (see
+  // RefreshStats::dropped_frames).
+  //
+  // The returned canvas has old content (the frame shown before, or a
+  // dropped one), so draw all pixels. Never blocks and doesn't take any lock
+  // the refresh thread waits on. Submitting NULL, or without a running
+  // refresh thread, does nothing and returns NULL.
+  // Use either this or SwapOnVSync(), not both.
+  FrameCanvas *SubmitFrame(FrameCanvas *other);
+
+  // Timed presentation, e.g. for playing animations without sleeping and
+  // swapping yourself.
+  //
+  // Queue "frame" to be shown from the first refresh that starts at or after
+  // "present_at_us" (CLOCK_MONOTONIC time in microseconds). Queue frames in
+  // the order of their presentation time. If several frames are due at the
+  // same refresh, only the last of them is shown.
+  // Returns false if the refresh thread is not running.
+  bool QueueFrame(FrameCanvas *frame, uint64_t present_at_us);
+
+  // Get back a queued frame that is not needed anymore, because a later
+  // frame replaced it on the screen or because it was skipped. Waits up to
+  // "timeout_ms" milliseconds (forever if negative); returns NULL on timeout.
+  // If "presented_at_us" is not NULL, it receives the time the frame was
+  // actually shown first (CLOCK_MONOTONIC, microseconds), 0 if it was skipped.
+  //
+  // The frame on the screen stays there until the next queued frame is due.
+  // Don't mix with SwapOnVSync() or SubmitFrame().
+  FrameCanvas *AwaitReleasedFrame(int timeout_ms, uint64_t *presented_at_us);
+
+  // Get a snapshot of the refresh statistics. This does not take any lock
+  // the refresh thread waits on, so it is cheap to poll e.g. for monitoring.
+  // Returns false (and leaves "stats" untouched) if the refresh thread is not
+  // running.
+  bool GetRefreshStats(RefreshStats *stats) const;
+
+  // Measure the time the refresh spends clocking in data, waiting for the
+  // output-enable pulses and switching rows (see RefreshTiming), to tune
+  // pwm bits, --led-pwm-lsb-nanoseconds and --led-slowdown-gpio from data.
+  // Enabling resets the measurement. While enabled, each bit-plane is timed,
+  // which costs a little refresh rate.
+  void EnableRefreshTiming(bool enable);
+
+  // Get the timing measured since enabled. Returns false if timing is not
+  // enabled or the refresh thread is not running.
+  bool GetRefreshTiming(RefreshTiming *timing) const;
+
   // -- Canvas interface. These write to the active FrameCanvas
   // (see documentation in canvas.h)
   virtual int width() const;
@@ -319,12 +522,22 @@ private:
   void ApplyNamedPixelMappers(const char *pixel_mapper_config,
                               int chain, int parallel);
 
+  // Get "frame" ready to be handed over to the refresh thread.
+  void PrepareFrame(FrameCanvas *frame);
+
+  // Create a FrameCanvas storing "columns" columns. If "own_mapper" is set,
+  // it uses the plain layout instead of the shared pixel mappers.
+  FrameCanvas *CreateCanvas(int columns, bool own_mapper);
+
 #ifndef REMOVE_DEPRECATED_TRANSFORMERS
   void ApplyStaticTransformerDeprecated(const CanvasTransformer &transformer);
 #endif  // REMOVE_DEPRECATED_TRANSFORMERS
 
   Options params_;
   bool do_luminance_correct_;
+  float gamma_[3];
+  float white_balance_[3];
+  int pwm_storage_bits_;  // Number of bitplanes allocated per FrameCanvas.
 
   FrameCanvas *active_;
 
@@ -334,6 +547,10 @@ private:
   CanvasTransformer *transformer_;  // deprecated. To be removed.
 #endif
   UpdateThread *updater_;
+  bool refresh_timing_;
+  // SubmitFrame() creates its third canvas in the calling thread, so
+  // created_frames_ and the settings applied to all of them are locked.
+  Mutex created_frames_lock_;
   std::vector<FrameCanvas*> created_frames_;
   internal::PixelDesignatorMap *shared_pixel_mapper_;
 };
@@ -343,7 +560,8 @@ public:
   // Set PWM bits used for this Frame.
   // Simple comic-colors, 1 might be sufficient (111 RGB, i.e. 8 colors).
   // Lower require less CPU.
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range (with
+  // Options::limit_pwm_storage, that is up to the initial pwm_bits).
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();
 
@@ -354,6 +572,10 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Per channel gamma (0 = CIE1931) and white balance (0..1).
+  void SetGamma(float red, float green, float blue);
+  void SetWhiteBalance(float red, float green, float blue);
+
   //-- Serialize()/Deserialize() are fast ways to store and re-create a canvas.
 
   // Provides a pointer to a buffer of the internal representation to
@@ -370,14 +592,97 @@ public:
 
   // Load data previously stored with Serialize(). Needs to be restored into
   // a FrameCanvas with exactly the same settings (rows, chain, transformer,...)
-  // as serialized.
+  // as serialized. Only the number of stored pwm bits may differ
+  // (see Options::limit_pwm_storage).
   // Returns 'false' if size is unexpected.
   // This method should only be called if FrameCanvas is off-screen.
   bool Deserialize(const char *data, size_t len);
 
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
+  // Only the parts that differ are copied, so this is cheap if the two
+  // canvases are mostly the same. Both need to be created the same way,
+  // CreateFrameCanvas() or CreateScrollCanvas() with the same width;
+  // otherwise nothing is copied.
   void CopyFrom(const FrameCanvas &other);
 
+  //-- Column scrolling, see RGBMatrix::CreateScrollCanvas().
+
+  // Show the columns starting at "column" on the panels: the first column
+  // of the chain shows canvas column "column", the next one "column" + 1
+  // and so on, wrapping around at width(). Any value is taken modulo the
+  // width. Costs nothing but takes effect with the next refresh, also on
+  // the canvas currently shown. Not stored by Serialize().
+  // Does nothing unless this is a scroll canvas wider than the panels.
+  void SetScrollOffset(int column);
+  int scroll_offset() const;
+
+  //-- Change tracking. The canvas keeps track of which rows have been
+  // modified. Rows are counted in the internal representation: each of
+  // these covers a row in the upper and lower half of every panel.
+
+  // Returns a bitmap of the rows modified since the last ClearDirtyRows()
+  // (bit n set: row n modified). If this is 0, the canvas did not change,
+  // so applications can skip e.g. swapping it or streaming it out.
+  uint64_t dirty_rows() const;
+
+  // Forget about previous modifications.
+  void ClearDirtyRows();
+
+  //-- Bulk upload of pixels. Much faster than calling SetPixel() for each
+  // pixel, as the conversion to the internal representation is done for
+  // several pixels at once.
+
+  // Set a rectangular area of "width" x "height" pixels with its upper left
+  // corner at ("x","y") from packed 24 bit RGB data (three bytes per pixel:
+  // red, green, blue). "stride" is the number of bytes between the beginning
+  // of two consecutive rows in "rgb"; if 0, rows are assumed to be tightly
+  // packed (width * 3). Pixels outside the canvas are ignored.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgb, int stride = 0);
+
+  // Set the whole canvas from a packed 24 bit RGB image of the size
+  // width() x height(). Same "stride" semantics as in SetPixels().
+  void SetImage(const uint8_t *rgb, int stride = 0);
+
+  // Fill a rectangular area of "width" x "height" pixels with its upper
+  // left corner at ("x","y") with the given color. Pixels outside the canvas
+  // are ignored.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+
+  // Copy the area of "width" x "height" pixels with its upper left corner
+  // at ("sx","sy") in "src" to ("dx","dy") in this canvas. Both need to be
+  // owned by the same RGBMatrix; "src" may be this canvas, the areas may
+  // overlap. The pixels are copied as they are stored, so this is much
+  // cheaper than SetPixel() or SetPixels() and keeps the brightness, gamma
+  // and white balance they were set with. Handy to compose layers of a
+  // dashboard prepared once on off-screen canvases. Pixels outside either
+  // canvas are ignored.
+  void BlitFrom(const FrameCanvas &src, int sx, int sy, int width, int height,
+                int dx, int dy);
+
+  //-- Reading back pixels, e.g. for effects that modify what is there
+  // already, without keeping a copy of the image around. The colors are
+  // reconstructed from the internal representation with the current
+  // brightness, gamma, white balance and PWM bits, so they are exact only
+  // where these map each color to a distinct value. Otherwise, the lowest
+  // color that maps the same is returned; in particular, dark colors often
+  // read as a bit darker. Setting a pixel to the color read keeps it as is.
+
+  // Get the color of the pixel at ("x","y"); black if outside the canvas.
+  void GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+
+  // Get a rectangular area of "width" x "height" pixels with its upper left
+  // corner at ("x","y") as packed 24 bit RGB data, see SetPixels() for
+  // the format. Pixels outside the canvas are left untouched in "rgb".
+  void GetPixels(int x, int y, int width, int height,
+                 uint8_t *rgb, int stride = 0) const;
+
+  // Get the whole canvas as packed 24 bit RGB image of the size
+  // width() x height(). Same "stride" semantics as in SetPixels().
+  void GetImage(uint8_t *rgb, int stride = 0) const;
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -388,6 +693,8 @@ public:
 
 private:
   friend class RGBMatrix;
+  friend class StreamWriter;
+  friend class StreamReader;
 
   FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
@@ -2,6 +2,7 @@
 
 #include "content-streamer.h"
 #include "led-matrix.h"
+#include "framebuffer-internal.h"
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -19,25 +20,45 @@ namespace {
 // Streams are stored in little-endian. This is the ARM default (running
 // the Raspberry Pi, but also x86; so it is possible to create streams easily
 // on a different x86 Linux PC.
-static const uint32_t kFileMagicValue = 0xED0C5A48;
+// The magic changed when delta frames and packed bitplanes came in, so that
+// older readers reject such streams instead of stopping at the first frame
+// they don't understand. Streams with the old magic only have full frames
+// and all flags zero; we still read them.
+static const uint32_t kFileMagicValue = 0xED0C5A49;
+static const uint32_t kFileMagicValueFullFrames = 0xED0C5A48;
+enum FileFlags {
+  kPackedBitplanes = 0x01,  // Frames are in the packed representation.
+};
 struct FileHeader {
   uint32_t magic;  // kFileMagicValue
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
+  uint32_t double_rows;  // Number of rows in the internal representation.
+  uint32_t flags;        // FileFlags
   uint64_t future_use2;
 };
 
 static const uint32_t kFrameMagicValue = 0x12345678;
+enum FrameFlags {
+  // Only contains the rows given in 'changed_rows', the others are the
+  // same as in the previous frame.
+  kDeltaFrame = 0x01,
+};
 struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
-  uint64_t future_use2;
+  uint32_t flags;         // FrameFlags
+  uint64_t changed_rows;  // kDeltaFrame: bitmap of rows contained.
   uint64_t future_use3;
 };
+
+static int CountBits(uint64_t bits) {
+  int result = 0;
+  for (/**/; bits; bits &= bits - 1) ++result;
+  return result;
+}
 }
 
 FileStreamIO::FileStreamIO(int fd) : fd_(fd) {}
@@ -97,12 +118,41 @@ bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
   if (!header_written_) {
     WriteFileHeader(frame, len);
   }
+
+  // Determine the rows that changed since the last frame we wrote.
+  const internal::Framebuffer *fb = frame.frame_;
+  const int double_rows = fb->double_rows();
+  const bool is_first_frame = row_versions_.empty();
+  row_versions_.resize(double_rows);
+  uint64_t changed_rows = 0;
+  for (int row = 0; row < double_rows; ++row) {
+    const internal::Framebuffer::RowVersion version = fb->row_version(row);
+    if (is_first_frame || version != row_versions_[row]) {
+      changed_rows |= 1ULL << row;
+      row_versions_[row] = version;
+    }
+  }
+
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
-  h.size = len;
   h.hold_time_us = hold_time_us;
+  if (CountBits(changed_rows) == double_rows) {
+    h.size = len;
+    FullAppend(io_, &h, sizeof(h));
+    return FullAppend(io_, data, len) == (ssize_t)len;
+  }
+
+  const size_t row_size = len / double_rows;
+  h.flags = kDeltaFrame;
+  h.changed_rows = changed_rows;
+  h.size = CountBits(changed_rows) * row_size;
   FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  for (int row = 0; row < double_rows; ++row) {
+    if ((changed_rows & (1ULL << row)) == 0) continue;
+    if (FullAppend(io_, data + row * row_size, row_size) != (ssize_t)row_size)
+      return false;
+  }
+  return true;
 }
 
 void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
@@ -111,12 +161,14 @@ void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
   header.width = frame.width();
   header.height = frame.height();
   header.buf_size = len;
+  header.double_rows = frame.frame_->double_rows();
+  header.flags = frame.frame_->packed() ? kPackedBitplanes : 0;
   FullAppend(io_, &header, sizeof(header));
   header_written_ = true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), buffer_(NULL) {
+  : io_(io), state_(STREAM_AT_BEGIN), buffer_(NULL), have_frame_(false) {
   io_->Rewind();
 }
 StreamReader::~StreamReader() { delete [] buffer_; }
@@ -124,6 +176,7 @@ StreamReader::~StreamReader() { delete [] buffer_; }
 void StreamReader::Rewind() {
   io_->Rewind();
   state_ = STREAM_AT_BEGIN;
+  have_frame_ = false;
 }
 
 bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
@@ -139,18 +192,36 @@ bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
     state_ = STREAM_ERROR;
     return false;
   }
-  // In the future, we might allow larger buffers (audio?), but never smaller.
-  if (h.size < buf_size_)
-    return false;
+  if (h.flags & kDeltaFrame) {
+    // Only the changed rows; the rest is still in our buffer.
+    if (!have_frame_ || double_rows_ <= 0 || double_rows_ > 64) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    const size_t row_size = buf_size_ / double_rows_;
+    if (h.size != CountBits(h.changed_rows) * row_size)
+      return false;
+    for (int row = 0; row < double_rows_; ++row) {
+      if ((h.changed_rows & (1ULL << row)) == 0) continue;
+      if (FullRead(io_, buffer_ + row * row_size, row_size) != (ssize_t)row_size)
+        return false;
+    }
+  } else {
+    // In the future, we might allow larger buffers (audio?), but never smaller.
+    if (h.size < buf_size_)
+      return false;
+    if (FullRead(io_, buffer_, buf_size_) != (ssize_t)buf_size_) return false;
+    have_frame_ = true;
+  }
   if (hold_time_us) *hold_time_us = h.hold_time_us;
-  if (FullRead(io_, buffer_, buf_size_) != (ssize_t)buf_size_) return false;
   return frame->Deserialize(buffer_, buf_size_);
 }
 
 bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
   FileHeader header;
   FullRead(io_, &header, sizeof(header));
-  if (header.magic != kFileMagicValue) {
+  if (header.magic != kFileMagicValue
+      && header.magic != kFileMagicValueFullFrames) {
     state_ = STREAM_ERROR;
     return false;
   }
@@ -162,8 +233,17 @@ bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
     state_ = STREAM_ERROR;
     return false;
   }
+  if (((header.flags & kPackedBitplanes) != 0) != frame.frame_->packed()) {
+    fprintf(stderr, "This stream is %spacked, can't play with%s "
+            "--led-packed-bitplanes\n",
+            (header.flags & kPackedBitplanes) ? "" : "not ",
+            (header.flags & kPackedBitplanes) ? "out" : "");
+    state_ = STREAM_ERROR;
+    return false;
+  }
   state_ = STREAM_READING;
   buf_size_ = header.buf_size;
+  double_rows_ = header.double_rows;
   if (!buffer_) buffer_ = new char [ header.buf_size ];
   return true;
 }
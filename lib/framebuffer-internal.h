@@ -18,45 +18,99 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <utility>
+#include <vector>
+
 #include "hardware-mapping.h"
 
 namespace rgb_matrix {
 class GPIO;
 class PinPulser;
+struct RefreshTiming;
 namespace internal {
 class RowAddressSetter;
 
-// An opaque type used within the framebuffer that can be used
-// to copy between PixelMappers.
-struct PixelDesignator {
-  PixelDesignator() : gpio_word(-1), r_bit(0), g_bit(0), b_bit(0), mask(~0){}
-  int gpio_word;
+// The color bits of a "lane", the pixels sharing a sub-panel of a parallel
+// chain. There are only a handful of these, so pixels just refer to them.
+struct LaneBits {
+  LaneBits() : r_bit(0), g_bit(0), b_bit(0), mask(~0) {}
   uint32_t r_bit;
   uint32_t g_bit;
   uint32_t b_bit;
   uint32_t mask;
 };
 
+// An opaque type used within the framebuffer that can be used
+// to copy between PixelMappers. To keep the per-pixel data small, it only
+// contains the offset of the pixel in the bitplane buffer (upper 24 bits) and
+// the index of its lane in the PixelDesignatorMap (lower 8 bits).
+typedef uint32_t PixelDesignator;
+static const PixelDesignator kUnusedPixel = ~0U;  // Non-used pixel marker.
+static const int kMaxDesignatorOffset = (1 << 24) - 1;
+
+inline PixelDesignator MakeDesignator(int gpio_word, int lane) {
+  return ((PixelDesignator)gpio_word << 8) | lane;
+}
+inline int DesignatorOffset(PixelDesignator d) { return d >> 8; }
+inline int DesignatorLane(PixelDesignator d) { return d & 0xff; }
+
+// A horizontal run of visible pixels that are consecutive in the bitplane
+// buffer and in the same lane, so they can be written in one go.
+struct PixelRun {
+  int x;                  // First column of the run.
+  int length;
+  PixelDesignator first;  // Designator of the pixel at "x".
+};
+
 class PixelDesignatorMap {
 public:
-  PixelDesignatorMap(int width, int height, const PixelDesignator &fill_bits);
+  // Runs never cross a multiple of "double_row_size" elements, so that each
+  // run is within one double row of the bitplane buffer.
+  PixelDesignatorMap(int width, int height, const LaneBits &fill_bits,
+                     int double_row_size);
+  // A map for re-arranging the designators of "other"; shares its lanes.
+  PixelDesignatorMap(int width, int height, const PixelDesignatorMap &other);
   ~PixelDesignatorMap();
 
   // Get a writable version of the PixelDesignator. Outside Framebuffer used
   // by the RGBMatrix to re-assign mappings to new PixelDesignatorMappers.
   PixelDesignator *get(int x, int y);
+  const PixelDesignator *get(int x, int y) const;
 
   inline int width() const { return width_; }
   inline int height() const { return height_; }
 
+  // Index of the lane with the given color bits; added if not known yet.
+  int AddLane(const LaneBits &bits);
+  inline const LaneBits &lane(int index) const { return lanes_[index]; }
+
   // All bits that set red/green/blue pixels; used for Fill().
-  const PixelDesignator &GetFillColorBits() { return fill_bits_; }
+  const LaneBits &GetFillColorBits() const { return fill_bits_; }
+
+  // Find the runs of all rows. Needs to be called after all designators
+  // are set. Only runs of at least kMinRunLength pixels are recorded; the
+  // remaining pixels are handled one by one.
+  enum { kMinRunLength = 8 };
+  void ComputeRuns();
+
+  // Runs of row "y" ordered by x; [row_runs_begin(y), row_runs_end(y))
+  inline const PixelRun *row_runs_begin(int y) const {
+    return runs_.data() + row_run_start_[y];
+  }
+  inline const PixelRun *row_runs_end(int y) const {
+    return runs_.data() + row_run_start_[y + 1];
+  }
 
 private:
   const int width_;
   const int height_;
-  const PixelDesignator fill_bits_;  // Precalculated for fill.
+  const LaneBits fill_bits_;  // Precalculated for fill.
+  const int double_row_size_;
+  std::vector<LaneBits> lanes_;
   PixelDesignator *const buffer_;
+  std::vector<PixelRun> runs_;
+  std::vector<int> row_run_start_;  // height_ + 1 indexes into runs_.
 };
 
 // Internal representation of the frame-buffer that as well can
@@ -65,10 +119,19 @@ private:
 // written out.
 class Framebuffer {
 public:
+  // "pwm_storage_bits" is the number of bitplanes allocated; SetPWMBits()
+  // can't go beyond that. If "packed" is set, only the color bits are stored
+  // (one byte per parallel chain) and expanded to GPIO words in
+  // DumpToMatrix(). All Framebuffers sharing a PixelDesignatorMap need to use
+  // the same values for these.
+  // Of the "columns" stored, DumpToMatrix() sends "shown_columns" to the
+  // panels, starting at the scroll offset. If "mapper" is NULL, the
+  // Framebuffer uses its own PixelDesignatorMap with the plain layout.
   Framebuffer(int rows, int columns, int parallel,
               int scan_mode,
               const char* led_sequence, bool inverse_color,
-              PixelDesignatorMap **mapper);
+              int pwm_storage_bits, bool packed,
+              PixelDesignatorMap **mapper, int shown_columns);
   ~Framebuffer();
 
   // Initialize GPIO bits for output. Only call once.
@@ -77,31 +140,80 @@ public:
                        bool allow_hardware_pulsing,
                        int pwm_lsb_nanoseconds,
                        int dither_bits,
-                       int row_address_type);
+                       int row_address_type,
+                       bool skip_blank_planes);
+
+  // Scale the output-enable pulses to the given percent (1..100) for
+  // instant dimming without changing any frame-buffer content. Only call
+  // from the refresh thread between DumpToMatrix() calls.
+  static void SetPulseScale(int percent);
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
-  // Returns boolean to signify if value was within range.
+  // Returns boolean to signify if value was within range, i.e. not more
+  // than the allocated pwm_storage_bits.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits() { return pwm_bits_; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on);
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
-  void SetBrightness(uint8_t b) {
-    brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
-  }
+  void SetBrightness(uint8_t b);
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io, int pwm_bits_to_show);
+  // Set the per channel (red, green, blue) correction: "gamma" of the
+  // luminance curve (<= 0: CIE1931) and "white_point" scaling the
+  // channel's luminance (0..1). Only affects newly set pixels.
+  void SetColorCorrection(const float gamma[3], const float white_point[3]);
+  const float *gamma() const { return gamma_; }
+  const float *white_point() const { return white_point_; }
+
+  // If "timing" is given, the time of each phase is added to it.
+  void DumpToMatrix(GPIO *io, int pwm_bits_to_show,
+                    RefreshTiming *timing = NULL);
+
+  // Precompute the GPIO words DumpToMatrix() writes, so that it only needs
+  // to stream them out. Only rows modified since the last call are compiled
+  // again. Until the next modification, DumpToMatrix() uses these words.
+  // Not thread-safe with modifications, call before handing the frame
+  // to the refresh thread.
+  void CompileScanStream();
 
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
 
+  // The first stored column sent to the panels; the following ones wrap
+  // around at the number of stored columns. Changing it is cheap and
+  // takes effect with the next refresh; it does not modify any row.
+  // Ignored unless more columns are stored than shown.
+  void SetScrollOffset(int column);
+  int scroll_offset() const {
+    return scroll_offset_.load(std::memory_order_relaxed);
+  }
+
+  // The buffer is organized in double rows, each covering a row in the upper
+  // and lower half of all panels. Changes are tracked per double row.
+  int double_rows() const { return double_rows_; }
+
+  // If the bitplanes are stored in the packed representation.
+  bool packed() const { return packed_buffer_ != NULL; }
+
+  // Bitmap of double rows that changed since the last ClearDirtyRows(),
+  // bit n representing double row n.
+  uint64_t dirty_rows() const { return dirty_rows_ | unversioned_rows_; }
+  void ClearDirtyRows();
+
+  // An identifier of the current content of the given double row: the id of
+  // the Framebuffer in which it last changed and the number of the change
+  // there. Rows of any two Framebuffers with the same version have the same
+  // content.
+  typedef std::pair<uint64_t, uint64_t> RowVersion;
+  RowVersion row_version(int double_row) const;
+
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
   int width() const;
@@ -110,10 +222,48 @@ public:
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Set a rectangle of pixels from packed 24-bit RGB data. "stride" is the
+  // distance in bytes between the beginning of consecutive rows in "rgb".
+  // Areas outside the canvas are clipped.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *rgb, int stride);
+
+  // Fill a rectangle with the given color. Areas outside are clipped.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+
+  // Copy the "width" x "height" pixels at ("sx","sy") of "src" to ("dx","dy")
+  // as they are stored, without converting colors. "src" may be this
+  // Framebuffer and needs the same "packed" and "pwm_storage_bits".
+  // Areas outside either one are clipped.
+  void BlitFrom(const Framebuffer &src, int sx, int sy, int width, int height,
+                int dx, int dy);
+
+  // Reconstruct the 8 bit colors from the bitplanes with the current
+  // color settings. Pixels outside the canvas are black.
+  void GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+  // Same for a rectangle, written as packed 24-bit RGB data with "stride"
+  // bytes between rows. Areas outside the canvas are left untouched.
+  void GetPixels(int x, int y, int width, int height,
+                 uint8_t *rgb, int stride) const;
+
 private:
   static const struct HardwareMapping *hardware_mapping_;
   static RowAddressSetter *row_setter_;
 
+  // DumpToMatrix() specialized for the number of parallel chains, the scan
+  // mode and the type of the row address setter, so that the compiler can
+  // drop the branches on these and inline the row address setting.
+  template <int kParallel, int kScanMode, class RowSetter>
+  void ScanOut(GPIO *io, int pwm_low_bit, RefreshTiming *timing);
+  typedef void (Framebuffer::*ScanOutFunction)(GPIO *io, int pwm_low_bit,
+                                               RefreshTiming *timing);
+  // The ScanOut() used by DumpToMatrix() for progressive and interlaced
+  // scan mode. Chosen by InitGPIO() with SelectScanOut().
+  static ScanOutFunction scan_out_[2];
+  template <class RowSetter> static void SelectScanOut(int parallel);
+
   // This returns the gpio-bit for given color (one of 'R', 'G', 'B'). This is
   // returning the right value in case "led_sequence" is _not_ "RGB"
   static gpio_bits_t GetGpioFromLedSequence(char col, const char *led_sequence,
@@ -123,34 +273,115 @@ private:
 
   void InitDefaultDesignator(int x, int y, const char *led_sequence,
                              PixelDesignator *designator);
+  // Recalculate color_lookup_ after brightness or luminance correction changed.
+  void UpdateColorLookup();
   inline void  MapColors(uint8_t r, uint8_t g, uint8_t b,
                          uint16_t *red, uint16_t *green, uint16_t *blue);
+  // Inverse of MapColors() for the bits of the planes shown.
+  inline void UnmapColors(uint16_t red, uint16_t green, uint16_t blue,
+                          uint8_t *pixel) const;
+  void UpdateInverseLookup();
+  inline void SetPixelBits(PixelDesignator designator,
+                           uint16_t red, uint16_t green, uint16_t blue);
+  template <typename T>
+  inline uint16_t SetRunPixels(T *bits, const LaneBits &lane, int min_plane,
+                               const uint8_t *pixel, int count);
+
+  // Mark the double row of the given gpio word or all rows as modified.
+  // This also invalidates the compiled scan stream.
+  inline void MarkModified(int gpio_word);
+  void MarkAllModified();
+  // Same, also noting that the bitplanes in "planes" might now be in use.
+  inline void MarkModified(int gpio_word, uint16_t planes);
+
+  // Recalculate used_planes_ of the given double row from its content.
+  void UpdateUsedPlanes(int double_row);
+
+  // Give all rows modified since the last call a new version.
+  void UpdateRowVersions() const;
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
   const int columns_;  // Number of columns. Number of chained boards * 32.
+  const int shown_columns_;  // Columns sent to the panels; <= columns_.
 
   const int scan_mode_;
   const bool inverse_color_;
+  const int stored_planes_;  // Only the upper stored_planes_ are allocated.
+  const int plane_stride_;   // Number of elements per bitplane of a row.
 
   uint8_t pwm_bits_;   // PWM bits to display.
   bool do_luminance_correct_;
   uint8_t brightness_;
+  float gamma_[3];        // Per channel; <= 0 means CIE1931.
+  float white_point_[3];  // Per channel luminance scale.
+
+  // Per channel, the bitplane bits for each 8 bit color value with the
+  // current brightness, luminance correction, gamma, white point and
+  // inverse applied.
+  uint16_t color_lookup_[3][256];
+
+  // Per channel, the 8 bit color value closest to each combination of the
+  // bitplanes shown. Updated along with color_lookup_ and pwm_bits_, so
+  // that reading pixels doesn't modify anything.
+  uint8_t *inverse_lookup_;
 
   const int double_rows_;
   const size_t buffer_size_;
 
   // The frame-buffer is organized in bitplanes.
   // Highest level (slowest to cycle through) are double rows.
-  // For each double-row, we store pwm-bits columns of a bitplane.
+  // For each double-row, we store stored_planes_ columns of a bitplane.
   // Each bitplane-column is pre-filled IoBits, of which the colors are set.
   // Of course, that means that we store unrelated bits in the frame-buffer,
   // but it allows easy access in the critical section.
   gpio_bits_t *bitplane_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // Alternatively, in the packed representation, each bitplane of a
+  // double-row consists of one byte per column for each parallel chain (one
+  // chain after another), with the bits R1 G1 B1 R2 G2 B2 from the LSB.
+  // Only one of bitplane_buffer_ and packed_buffer_ is allocated.
+  uint8_t *packed_buffer_;
+  inline uint8_t *PackedAt(int double_row, int column, int bit);
+
+  // Index of an element in either of these buffers.
+  inline int IndexAt(int double_row, int column, int bit) const;
+  char *RawBuffer() const;
+
+  // The compiled scan stream: for each column of each bitplane of a double
+  // row, the pair of words to clear and then set while clocking it in. NULL
+  // until CompileScanStream() is called the first time.
+  gpio_bits_t *scan_stream_;
+  inline gpio_bits_t *ScanStreamAt(int double_row, int bit) const;
+  RowVersion *scan_stream_version_;  // Row versions the stream was made from.
+  std::atomic<bool> scan_stream_valid_;
+
+  PixelDesignatorMap *own_mapper_;      // If not shared with others.
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
+
+  // Modified rows are first only marked in unversioned_rows_, which is cheap
+  // to do in SetPixel(). They get a new version (and are moved to
+  // dirty_rows_) lazily once someone is interested.
+  const uint64_t id_;  // Unique per Framebuffer, never 0.
+  mutable uint64_t unversioned_rows_;
+  mutable uint64_t dirty_rows_;
+  mutable uint64_t next_version_;
+  mutable RowVersion *row_version_;
+
+  std::atomic<int> scroll_offset_;
+
+  // Per double row, bit b set if bitplane b might have any color bit set.
+  // Writes only add bits, so it can be too generous but is never missing
+  // a plane; Clear(), Fill() and Deserialize() make it exact again.
+  uint16_t *used_planes_;
 };
+
+// Parse a color correction value given either as one number for all
+// channels or as three comma separated numbers for red, green and blue.
+// Returns false if unparseable or outside of [min_value, max_value].
+bool ParseColorCorrection(const char *spec, float min_value, float max_value,
+                          float result[3]);
 }  // namespace internal
 }  // namespace rgb_matrix
 #endif // RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
@@ -26,10 +26,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <algorithm>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 #include "gpio.h"
+#include "led-matrix.h"
 
 namespace rgb_matrix {
 namespace internal {
@@ -41,6 +49,16 @@ enum {
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
 
+// Each Framebuffer gets a different id to make its row versions unique.
+static uint64_t sNextFramebufferId = 0;
+
+// For the packed representation: the GPIO bits for each possible combination
+// of the R1 G1 B1 R2 G2 B2 bits, per parallel chain.
+static gpio_bits_t sPackedToGpio[3][64];
+
+// If DumpToMatrix() should not clock in bitplanes without any LED on.
+static bool sSkipBlankPlanes = false;
+
 #ifdef ONLY_SINGLE_SUB_PANEL
 #  define SUB_PANELS_ 1
 #else
@@ -53,10 +71,70 @@ PixelDesignator *PixelDesignatorMap::get(int x, int y) {
   return buffer_ + (y*width_) + x;
 }
 
+const PixelDesignator *PixelDesignatorMap::get(int x, int y) const {
+  if (x < 0 || y < 0 || x >= width_ || y >= height_)
+    return NULL;
+  return buffer_ + (y*width_) + x;
+}
+
 PixelDesignatorMap::PixelDesignatorMap(int width, int height,
-                                       const PixelDesignator &fill_bits)
+                                       const LaneBits &fill_bits,
+                                       int double_row_size)
   : width_(width), height_(height), fill_bits_(fill_bits),
-    buffer_(new PixelDesignator[width * height]) {
+    double_row_size_(double_row_size),
+    buffer_(new PixelDesignator[width * height]),
+    row_run_start_(height + 1, 0) {
+  std::fill(buffer_, buffer_ + width * height, kUnusedPixel);
+}
+
+PixelDesignatorMap::PixelDesignatorMap(int width, int height,
+                                       const PixelDesignatorMap &other)
+  : width_(width), height_(height), fill_bits_(other.fill_bits_),
+    double_row_size_(other.double_row_size_),
+    lanes_(other.lanes_), buffer_(new PixelDesignator[width * height]),
+    row_run_start_(height + 1, 0) {
+  std::fill(buffer_, buffer_ + width * height, kUnusedPixel);
+}
+
+void PixelDesignatorMap::ComputeRuns() {
+  runs_.clear();
+  for (int y = 0; y < height_; ++y) {
+    row_run_start_[y] = runs_.size();
+    const PixelDesignator *row = buffer_ + y * width_;
+    int x = 0;
+    while (x < width_) {
+      const PixelDesignator first = row[x];
+      int length = 1;
+      if (first != kUnusedPixel) {
+        const int row_end = (DesignatorOffset(first) / double_row_size_ + 1)
+          * double_row_size_;
+        while (x + length < width_
+               && DesignatorOffset(first) + length < row_end
+               && row[x + length] == first + MakeDesignator(length, 0)) {
+          ++length;
+        }
+        if (length >= kMinRunLength) {
+          const PixelRun run = { x, length, first };
+          runs_.push_back(run);
+        }
+      }
+      x += length;
+    }
+  }
+  row_run_start_[height_] = runs_.size();
+}
+
+int PixelDesignatorMap::AddLane(const LaneBits &bits) {
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    const LaneBits &l = lanes_[i];
+    if (l.r_bit == bits.r_bit && l.g_bit == bits.g_bit
+        && l.b_bit == bits.b_bit && l.mask == bits.mask)
+      return i;
+  }
+  // Lane 0xff is reserved for kUnusedPixel.
+  assert(lanes_.size() < 0xff);
+  lanes_.push_back(bits);
+  return lanes_.size() - 1;
 }
 
 PixelDesignatorMap::~PixelDesignatorMap() {
@@ -126,6 +204,16 @@ public:
 
   virtual void SetRowAddress(GPIO *io, int row) {
     if (row == last_row_) return;
+    // Going to the next row, all bits just move on by one, so one clock with
+    // a high bit gives the same register content as loading everything.
+    // Not after row 0: its last clock shifts in a low bit.
+    if (row == last_row_ + 1 && last_row_ > 0) {
+      io->ClearBits(clock_);
+      io->SetBits(data_);
+      io->SetBits(clock_);
+      last_row_ = row;
+      return;
+    }
     for (int activate = 0; activate < double_rows_; ++activate) {
       io->ClearBits(clock_);
       if (activate == double_rows_ - 1 - row) {
@@ -148,6 +236,50 @@ private:
   int last_row_;
 };
 
+// Row drivers that are a shift register with a separate latch, such as a
+// chain of 74HC595 or a 74HC164 followed by a latch: A is the shift clock,
+// B the data, C latches the shifted bits to the outputs. A high output
+// selects the row.
+class ABCShiftRegisterRowAddressSetter : public RowAddressSetter {
+public:
+  ABCShiftRegisterRowAddressSetter(int double_rows, const HardwareMapping &h)
+    : double_rows_(double_rows),
+      row_mask_(h.a | h.b | h.c), clock_(h.a), data_(h.b), latch_(h.c),
+      last_row_(-1) {
+  }
+  virtual gpio_bits_t need_bits() const { return row_mask_; }
+
+  virtual void SetRowAddress(GPIO *io, int row) {
+    if (row == last_row_) return;
+    if (row == last_row_ + 1 && last_row_ >= 0) {
+      // Next row: shift the selected bit on by one.
+      io->ClearBits(clock_ | data_);
+      io->SetBits(clock_);
+    } else {
+      for (int activate = 0; activate < double_rows_; ++activate) {
+        io->ClearBits(clock_);
+        if (activate == double_rows_ - 1 - row) {
+          io->SetBits(data_);
+        } else {
+          io->ClearBits(data_);
+        }
+        io->SetBits(clock_);
+      }
+    }
+    io->SetBits(latch_);
+    io->ClearBits(latch_);
+    last_row_ = row;
+  }
+
+private:
+  const int double_rows_;
+  const gpio_bits_t row_mask_;
+  const gpio_bits_t clock_;
+  const gpio_bits_t data_;
+  const gpio_bits_t latch_;
+  int last_row_;
+};
+
 // The DirectABCDRowAddressSetter sets the address by one of
 // row pin ABCD for 32х16 matrix 1:4 multiplexing. The matrix has
 // 4 addressable rows. Row is selected by a low level on the
@@ -192,24 +324,39 @@ private:
 
 const struct HardwareMapping *Framebuffer::hardware_mapping_ = NULL;
 RowAddressSetter *Framebuffer::row_setter_ = NULL;
+Framebuffer::ScanOutFunction Framebuffer::scan_out_[2] = { NULL, NULL };
 
 Framebuffer::Framebuffer(int rows, int columns, int parallel,
                          int scan_mode,
                          const char *led_sequence, bool inverse_color,
-                         PixelDesignatorMap **mapper)
+                         int pwm_storage_bits, bool packed,
+                         PixelDesignatorMap **mapper, int shown_columns)
   : rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
+    shown_columns_(shown_columns),
     scan_mode_(scan_mode),
     inverse_color_(inverse_color),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
+    stored_planes_(pwm_storage_bits),
+    plane_stride_(packed ? columns * parallel : columns),
+    pwm_bits_(pwm_storage_bits), do_luminance_correct_(true), brightness_(100),
+    inverse_lookup_(NULL),
     double_rows_(rows / SUB_PANELS_),
-    buffer_size_(double_rows_ * columns_ * kBitPlanes * sizeof(gpio_bits_t)),
-    shared_mapper_(mapper) {
+    buffer_size_(double_rows_ * plane_stride_ * stored_planes_
+                 * (packed ? sizeof(uint8_t) : sizeof(gpio_bits_t))),
+    scan_stream_(NULL), scan_stream_version_(NULL), scan_stream_valid_(false),
+    own_mapper_(NULL),
+    shared_mapper_(mapper ? mapper : &own_mapper_),
+    id_(++sNextFramebufferId),
+    unversioned_rows_(0), dirty_rows_(0), next_version_(0), scroll_offset_(0) {
   assert(hardware_mapping_ != NULL);   // Called InitHardwareMapping() ?
-  assert(shared_mapper_ != NULL);  // Storage should be provided by RGBMatrix.
+  assert(shown_columns_ >= 1 && shown_columns_ <= columns_);
   assert(rows_ >=4 && rows_ <= 64 && rows_ % 2 == 0);
+  assert(double_rows_ <= 64);  // Need to fit into dirty-row bitmaps.
+  assert(stored_planes_ >= 1 && stored_planes_ <= kBitPlanes);
+  // Offsets need to fit into a PixelDesignator.
+  assert(double_rows_ * plane_stride_ * stored_planes_ <= kMaxDesignatorOffset);
   if (parallel > hardware_mapping_->max_parallel_chains) {
     fprintf(stderr, "The %s GPIO mapping only supports %d parallel chain%s, "
             "but %d was requested.\n", hardware_mapping_->name,
@@ -219,7 +366,18 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   }
   assert(parallel >= 1 && parallel <= 3);
 
-  bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  if (packed) {
+    bitplane_buffer_ = NULL;
+    packed_buffer_ = new uint8_t[double_rows_ * plane_stride_ * stored_planes_];
+  } else {
+    bitplane_buffer_ = new gpio_bits_t[double_rows_ * plane_stride_ * stored_planes_];
+    packed_buffer_ = NULL;
+  }
+  row_version_ = new RowVersion[double_rows_];
+  used_planes_ = new uint16_t[double_rows_];
+  for (int row = 0; row < double_rows_; ++row) {
+    used_planes_[row] = (1 << kBitPlanes) - 1;  // Unknown yet.
+  }
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -236,24 +394,43 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
     gpio_bits_t r = h.p0_r1 | h.p0_r2 | h.p1_r1 | h.p1_r2 | h.p2_r1 | h.p2_r2;
     gpio_bits_t g = h.p0_g1 | h.p0_g2 | h.p1_g1 | h.p1_g2 | h.p2_g1 | h.p2_g2;
     gpio_bits_t b = h.p0_b1 | h.p0_b2 | h.p1_b1 | h.p1_b2 | h.p2_b1 | h.p2_b2;
-    PixelDesignator fill_bits;
+    if (packed) {
+      r = 0x01 | 0x08;
+      g = 0x02 | 0x10;
+      b = 0x04 | 0x20;
+    }
+    LaneBits fill_bits;
     fill_bits.r_bit = GetGpioFromLedSequence('R', led_sequence, r, g, b);
     fill_bits.g_bit = GetGpioFromLedSequence('G', led_sequence, r, g, b);
     fill_bits.b_bit = GetGpioFromLedSequence('B', led_sequence, r, g, b);
 
-    *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits);
+    *shared_mapper_ = new PixelDesignatorMap(columns_, height_, fill_bits,
+                                             plane_stride_ * stored_planes_);
     for (int y = 0; y < height_; ++y) {
       for (int x = 0; x < columns_; ++x) {
         InitDefaultDesignator(x, y, led_sequence, (*shared_mapper_)->get(x, y));
       }
     }
+    (*shared_mapper_)->ComputeRuns();
   }
 
+  for (int ch = 0; ch < 3; ++ch) {
+    gamma_[ch] = 0;
+    white_point_[ch] = 1.0f;
+  }
+  UpdateColorLookup();
   Clear();
 }
 
 Framebuffer::~Framebuffer() {
+  delete own_mapper_;
+  delete [] scan_stream_version_;
+  delete [] scan_stream_;
+  delete [] used_planes_;
+  delete [] inverse_lookup_;
+  delete [] row_version_;
   delete [] bitplane_buffer_;
+  delete [] packed_buffer_;
 }
 
 // TODO: this should also be parsed from some special formatted string, e.g.
@@ -293,16 +470,55 @@ Framebuffer::~Framebuffer() {
       ++mapping->max_parallel_chains;
   }
   hardware_mapping_ = mapping;
+
+  const gpio_bits_t chain_bits[3][6] = {
+    { mapping->p0_r1, mapping->p0_g1, mapping->p0_b1,
+      mapping->p0_r2, mapping->p0_g2, mapping->p0_b2 },
+    { mapping->p1_r1, mapping->p1_g1, mapping->p1_b1,
+      mapping->p1_r2, mapping->p1_g2, mapping->p1_b2 },
+    { mapping->p2_r1, mapping->p2_g1, mapping->p2_b1,
+      mapping->p2_r2, mapping->p2_g2, mapping->p2_b2 },
+  };
+  for (int chain = 0; chain < 3; ++chain) {
+    for (int packed = 0; packed < 64; ++packed) {
+      gpio_bits_t bits = 0;
+      for (int i = 0; i < 6; ++i) {
+        if (packed & (1 << i)) bits |= chain_bits[chain][i];
+      }
+      sPackedToGpio[chain][packed] = bits;
+    }
+  }
+}
+
+template <class RowSetter>
+/* static */ void Framebuffer::SelectScanOut(int parallel) {
+  switch (parallel) {
+  case 1:
+    scan_out_[0] = &Framebuffer::ScanOut<1, 0, RowSetter>;
+    scan_out_[1] = &Framebuffer::ScanOut<1, 1, RowSetter>;
+    break;
+  case 2:
+    scan_out_[0] = &Framebuffer::ScanOut<2, 0, RowSetter>;
+    scan_out_[1] = &Framebuffer::ScanOut<2, 1, RowSetter>;
+    break;
+  default:
+    scan_out_[0] = &Framebuffer::ScanOut<3, 0, RowSetter>;
+    scan_out_[1] = &Framebuffer::ScanOut<3, 1, RowSetter>;
+    break;
+  }
 }
 
 /* static */ void Framebuffer::InitGPIO(GPIO *io, int rows, int parallel,
                                         bool allow_hardware_pulsing,
                                         int pwm_lsb_nanoseconds,
                                         int dither_bits,
-                                        int row_address_type) {
+                                        int row_address_type,
+                                        bool skip_blank_planes) {
   if (sOutputEnablePulser != NULL)
     return;  // already initialized.
 
+  sSkipBlankPlanes = skip_blank_planes;
+
   const struct HardwareMapping &h = *hardware_mapping_;
   // Tell GPIO about all bits we intend to use.
   gpio_bits_t all_used_bits = 0;
@@ -321,12 +537,19 @@ Framebuffer::~Framebuffer() {
   switch (row_address_type) {
   case 0:
     row_setter_ = new DirectRowAddressSetter(double_rows, h);
+    SelectScanOut<DirectRowAddressSetter>(parallel);
     break;
   case 1:
     row_setter_ = new ShiftRegisterRowAddressSetter(double_rows, h);
+    SelectScanOut<ShiftRegisterRowAddressSetter>(parallel);
     break;
   case 2:
     row_setter_ = new DirectABCDLineRowAddressSetter(double_rows, h);
+    SelectScanOut<DirectABCDLineRowAddressSetter>(parallel);
+    break;
+  case 3:
+    row_setter_ = new ABCShiftRegisterRowAddressSetter(double_rows, h);
+    SelectScanOut<ABCShiftRegisterRowAddressSetter>(parallel);
     break;
   default:
     assert(0);  // unexpected type.
@@ -352,17 +575,99 @@ Framebuffer::~Framebuffer() {
                                           bitplane_timings);
 }
 
+/* static */ void Framebuffer::SetPulseScale(int percent) {
+  if (sOutputEnablePulser == NULL) return;
+  percent = (percent <= 100 ? (percent > 0 ? percent : 1) : 100);
+  sOutputEnablePulser->SetPulseScale(percent);
+}
+
 bool Framebuffer::SetPWMBits(uint8_t value) {
-  if (value < 1 || value > kBitPlanes)
+  if (value < 1 || value > stored_planes_)
     return false;
-  pwm_bits_ = value;
+  if (value != pwm_bits_) {
+    pwm_bits_ = value;
+    UpdateInverseLookup();
+  }
   return true;
 }
 
+inline int Framebuffer::IndexAt(int double_row, int column, int bit) const {
+  return (double_row * (plane_stride_ * stored_planes_)
+          + (bit - (kBitPlanes - stored_planes_)) * plane_stride_
+          + column);
+}
+
 inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
-                            + bit * columns_
-                            + column ];
+  return &bitplane_buffer_[IndexAt(double_row, column, bit)];
+}
+
+inline uint8_t *Framebuffer::PackedAt(int double_row, int column, int bit) {
+  return &packed_buffer_[IndexAt(double_row, column, bit)];
+}
+
+inline gpio_bits_t *Framebuffer::ScanStreamAt(int double_row, int bit) const {
+  return scan_stream_ + 2 * columns_ * (double_row * stored_planes_
+                                        + bit - (kBitPlanes - stored_planes_));
+}
+
+char *Framebuffer::RawBuffer() const {
+  return packed_buffer_ ? reinterpret_cast<char*>(packed_buffer_)
+    : reinterpret_cast<char*>(bitplane_buffer_);
+}
+
+inline void Framebuffer::MarkModified(int gpio_word) {
+  unversioned_rows_ |= 1ULL << (gpio_word / (plane_stride_ * stored_planes_));
+  scan_stream_valid_.store(false, std::memory_order_relaxed);
+}
+
+void Framebuffer::MarkAllModified() {
+  unversioned_rows_ = (double_rows_ < 64) ? (1ULL << double_rows_) - 1 : ~0ULL;
+  scan_stream_valid_.store(false, std::memory_order_relaxed);
+}
+
+inline void Framebuffer::MarkModified(int gpio_word, uint16_t planes) {
+  const int double_row = gpio_word / (plane_stride_ * stored_planes_);
+  unversioned_rows_ |= 1ULL << double_row;
+  used_planes_[double_row] |= planes;
+  scan_stream_valid_.store(false, std::memory_order_relaxed);
+}
+
+void Framebuffer::UpdateUsedPlanes(int double_row) {
+  // In the packed representation, all bits are color bits.
+  const gpio_bits_t color_bits = packed_buffer_ ? 0xff
+    : ((*shared_mapper_)->GetFillColorBits().r_bit
+       | (*shared_mapper_)->GetFillColorBits().g_bit
+       | (*shared_mapper_)->GetFillColorBits().b_bit);
+  uint16_t used = 0;
+  for (int b = kBitPlanes - stored_planes_; b < kBitPlanes; ++b) {
+    const int start = IndexAt(double_row, 0, b);
+    gpio_bits_t any = 0;
+    for (int i = start; i < start + plane_stride_; ++i) {
+      any |= packed_buffer_ ? packed_buffer_[i] : bitplane_buffer_[i];
+    }
+    if (any & color_bits) used |= 1 << b;
+  }
+  used_planes_[double_row] = used;
+}
+
+void Framebuffer::UpdateRowVersions() const {
+  if (!unversioned_rows_) return;
+  for (int row = 0; row < double_rows_; ++row) {
+    if (unversioned_rows_ & (1ULL << row))
+      row_version_[row] = RowVersion(id_, next_version_++);
+  }
+  dirty_rows_ |= unversioned_rows_;
+  unversioned_rows_ = 0;
+}
+
+Framebuffer::RowVersion Framebuffer::row_version(int double_row) const {
+  UpdateRowVersions();
+  return row_version_[double_row];
+}
+
+void Framebuffer::ClearDirtyRows() {
+  UpdateRowVersions();
+  dirty_rows_ = 0;
 }
 
 void Framebuffer::Clear() {
@@ -370,33 +675,37 @@ void Framebuffer::Clear() {
     Fill(0, 0, 0);
   } else  {
     // Cheaper.
-    memset(bitplane_buffer_, 0,
-           sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+    memset(RawBuffer(), 0, buffer_size_);
+    memset(used_planes_, 0, double_rows_ * sizeof(*used_planes_));
+    MarkAllModified();
   }
 }
 
-// Do CIE1931 luminance correction and scale to output bitplanes
-static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
-  float out_factor = ((1 << kBitPlanes) - 1);
-  float v = (float) c * brightness / 255.0;
-  return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
+// CIE1931 luminance (0..1) for the given lightness in percent (0..100).
+static constexpr double cie1931(double v) {
+  return (v <= 8)
+    ? v / 902.3
+    : ((v + 16) / 116.0) * ((v + 16) / 116.0) * ((v + 16) / 116.0);
 }
 
-struct ColorLookup {
-  uint16_t color[256];
+// CIE1931 corrected bitplane values for each brightness (1..100) and color.
+// Evaluated by the compiler, so there is no startup cost and no allocation.
+struct CIE1931LookupTable {
+  constexpr CIE1931LookupTable() : color() {
+    for (int b = 0; b < 100; ++b) {
+      for (int c = 0; c < 256; ++c) {
+        const float out_factor = ((1 << kBitPlanes) - 1);
+        const float v = (float) c * (b + 1) / 255.0;
+        color[b][c] = out_factor * cie1931(v);
+      }
+    }
+  }
+  uint16_t color[100][256];
 };
-static ColorLookup *CreateLuminanceCIE1931LookupTable() {
-  ColorLookup *for_brightness = new ColorLookup[100];
-  for (int c = 0; c < 256; ++c)
-    for (int b = 0; b < 100; ++b)
-      for_brightness[b].color[c] = luminance_cie1931(c, b + 1);
-
-  return for_brightness;
-}
+static constexpr CIE1931LookupTable kCIE1931Lookup;
 
 static inline uint16_t CIEMapColor(uint8_t brightness, uint8_t c) {
-  static ColorLookup *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-  return luminance_lookup[brightness - 1].color[c];
+  return kCIE1931Lookup.color[brightness - 1][c];
 }
 
 // Non luminance correction. TODO: consider getting rid of this.
@@ -408,31 +717,149 @@ static inline uint16_t DirectMapColor(uint8_t brightness, uint8_t c) {
   return (shift > 0) ? (c << shift) : (c >> -shift);
 }
 
+// Bitplane value for a color with an arbitrary correction: "gamma" <= 0
+// selects the CIE1931 curve, otherwise a plain power curve is used. The
+// "white_point" scales the resulting luminance of the channel (0..1).
+// Only used while building the lookup tables, never per pixel.
+static uint16_t CorrectedMapColor(uint8_t brightness, uint8_t c,
+                                  bool luminance_correct,
+                                  float gamma, float white_point) {
+  const float out_factor = ((1 << kBitPlanes) - 1);
+  const float v = (float) c * brightness / 255.0;  // Percent.
+  float luminance;
+  if (!luminance_correct)
+    luminance = v / 100.0;
+  else if (gamma <= 0)
+    luminance = cie1931(v);
+  else
+    luminance = pow(v / 100.0, gamma);
+  return out_factor * white_point * luminance;
+}
+
+void Framebuffer::UpdateColorLookup() {
+  for (int ch = 0; ch < 3; ++ch) {
+    const bool uncorrected = (gamma_[ch] <= 0 && white_point_[ch] == 1.0f);
+    for (int c = 0; c < 256; ++c) {
+      uint16_t value;
+      if (uncorrected) {
+        value = (do_luminance_correct_
+                 ? CIEMapColor(brightness_, c)
+                 : DirectMapColor(brightness_, c));
+      } else {
+        value = CorrectedMapColor(brightness_, c, do_luminance_correct_,
+                                  gamma_[ch], white_point_[ch]);
+      }
+      if (inverse_color_) value = ~value;
+      color_lookup_[ch][c] = value;
+    }
+  }
+  UpdateInverseLookup();
+}
+
+void Framebuffer::UpdateInverseLookup() {
+  if (inverse_lookup_ == NULL) {
+    inverse_lookup_ = new uint8_t[3 << kBitPlanes];
+  }
+  const uint16_t shown = (1 << kBitPlanes) - (1 << (kBitPlanes - pwm_bits_));
+  for (int ch = 0; ch < 3; ++ch) {
+    // The shown part of the lookup is monotonic; for each value, walk to the
+    // closest color, the lowest of several mapping to the same value.
+    int mapped[256];
+    for (int c = 0; c < 256; ++c) {
+      const uint16_t value = color_lookup_[ch][c];
+      mapped[c] = (inverse_color_ ? ~value : value) & shown;
+    }
+    uint8_t *const inverse = inverse_lookup_ + (ch << kBitPlanes);
+    int c = 0;
+    int next = 1;  // First color with a different value than "c".
+    while (next < 256 && mapped[next] == mapped[c]) ++next;
+    for (int value = 0; value < (1 << kBitPlanes); ++value) {
+      while (next < 256
+             && abs(mapped[next] - value) < abs(mapped[c] - value)) {
+        c = next;
+        while (next < 256 && mapped[next] == mapped[c]) ++next;
+      }
+      inverse[value] = c;
+    }
+  }
+}
+
+void Framebuffer::SetColorCorrection(const float gamma[3],
+                                     const float white_point[3]) {
+  bool changed = false;
+  for (int ch = 0; ch < 3; ++ch) {
+    const float g = gamma[ch] > 0 ? gamma[ch] : 0;
+    const float w = white_point[ch] < 0 ? 0 : (white_point[ch] > 1
+                                               ? 1 : white_point[ch]);
+    changed |= (g != gamma_[ch] || w != white_point_[ch]);
+    gamma_[ch] = g;
+    white_point_[ch] = w;
+  }
+  if (changed) UpdateColorLookup();
+}
+
+bool ParseColorCorrection(const char *spec, float min_value, float max_value,
+                          float result[3]) {
+  if (spec == NULL) return false;
+  const char *pos = spec;
+  int count = 0;
+  while (count < 3) {
+    char *end;
+    const double value = strtod(pos, &end);
+    if (end == pos || value < min_value || value > max_value)
+      return false;
+    result[count++] = value;
+    pos = end;
+    if (*pos != ',') break;
+    ++pos;
+  }
+  if (*pos != '\0') return false;
+  if (count == 1) {
+    result[1] = result[2] = result[0];
+  } else if (count != 3) {
+    return false;
+  }
+  return true;
+}
+
+void Framebuffer::set_luminance_correct(bool on) {
+  if (on == do_luminance_correct_) return;
+  do_luminance_correct_ = on;
+  UpdateColorLookup();
+}
+
+void Framebuffer::SetBrightness(uint8_t b) {
+  b = (b <= 100 ? (b != 0 ? b : 1) : 100);
+  if (b == brightness_) return;
+  brightness_ = b;
+  UpdateColorLookup();
+}
+
 inline void Framebuffer::MapColors(
   uint8_t r, uint8_t g, uint8_t b,
   uint16_t *red, uint16_t *green, uint16_t *blue) {
+  *red   = color_lookup_[0][r];
+  *green = color_lookup_[1][g];
+  *blue  = color_lookup_[2][b];
+}
 
-  if (do_luminance_correct_) {
-    *red   = CIEMapColor(brightness_, r);
-    *green = CIEMapColor(brightness_, g);
-    *blue  = CIEMapColor(brightness_, b);
-  } else {
-    *red   = DirectMapColor(brightness_, r);
-    *green = DirectMapColor(brightness_, g);
-    *blue  = DirectMapColor(brightness_, b);
-  }
-
+inline void Framebuffer::UnmapColors(uint16_t red, uint16_t green,
+                                     uint16_t blue, uint8_t *pixel) const {
   if (inverse_color_) {
-    *red = ~(*red);
-    *green = ~(*green);
-    *blue = ~(*blue);
+    const uint16_t shown = (1 << kBitPlanes) - (1 << (kBitPlanes - pwm_bits_));
+    red ^= shown;
+    green ^= shown;
+    blue ^= shown;
   }
+  pixel[0] = inverse_lookup_[red];
+  pixel[1] = inverse_lookup_[(1 << kBitPlanes) + green];
+  pixel[2] = inverse_lookup_[(2 << kBitPlanes) + blue];
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
-  const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  const LaneBits &fill = (*shared_mapper_)->GetFillColorBits();
 
   for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
     uint16_t mask = 1 << b;
@@ -442,12 +869,23 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
     plane_bits |= ((blue & mask) == mask)  ? fill.b_bit : 0;
 
     for (int row = 0; row < double_rows_; ++row) {
+      if (packed_buffer_) {
+        memset(PackedAt(row, 0, b), plane_bits, plane_stride_);
+        continue;
+      }
       uint32_t *row_data = ValueAt(row, 0, b);
       for (int col = 0; col < columns_; ++col) {
         *row_data++ = plane_bits;
       }
     }
   }
+  // The planes below the PWM bits are not touched and stay as they are.
+  const uint16_t written = ((1 << pwm_bits_) - 1) << (kBitPlanes - pwm_bits_);
+  for (int row = 0; row < double_rows_; ++row) {
+    used_planes_[row] = (used_planes_[row] & ~written)
+      | ((red | green | blue) & written);
+  }
+  MarkAllModified();
 }
 
 int Framebuffer::width() const { return (*shared_mapper_)->width(); }
@@ -456,26 +894,591 @@ int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
   if (designator == NULL) return;
-  const int pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  if (*designator == kUnusedPixel) return;
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  SetPixelBits(*designator, red, green, blue);
+  MarkModified(DesignatorOffset(*designator), red | green | blue);
+}
 
-  uint32_t *bits = bitplane_buffer_ + pos;
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  bits += (columns_ * min_bit_plane);
-  const uint32_t r_bits = designator->r_bit;
-  const uint32_t g_bits = designator->g_bit;
-  const uint32_t b_bits = designator->b_bit;
-  const uint32_t designator_mask = designator->mask;
-  for (uint16_t mask = 1<<min_bit_plane; mask != 1<<kBitPlanes; mask <<=1 ) {
-    uint32_t color_bits = 0;
-    if (red & mask)   color_bits |= r_bits;
-    if (green & mask) color_bits |= g_bits;
-    if (blue & mask)  color_bits |= b_bits;
+// Set the bits of a pixel in all planes starting with "min_plane"; "bits"
+// points to its element in that plane. Works for both representations.
+template <typename T>
+static inline void SetPlaneBits(T *bits, int plane_stride, int min_plane,
+                                const LaneBits &lane,
+                                uint16_t red, uint16_t green, uint16_t blue) {
+  const uint32_t r_bits = lane.r_bit;
+  const uint32_t g_bits = lane.g_bit;
+  const uint32_t b_bits = lane.b_bit;
+  const uint32_t designator_mask = lane.mask;
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    // Branch-free: a set bit becomes an all-ones mask.
+    const uint32_t color_bits = (r_bits & -(uint32_t)((red >> plane) & 1))
+      | (g_bits & -(uint32_t)((green >> plane) & 1))
+      | (b_bits & -(uint32_t)((blue >> plane) & 1));
     *bits = (*bits & designator_mask) | color_bits;
-    bits += columns_;
+    bits += plane_stride;
+  }
+}
+
+inline void Framebuffer::SetPixelBits(PixelDesignator designator,
+                                      uint16_t red, uint16_t green,
+                                      uint16_t blue) {
+  const LaneBits &lane = (*shared_mapper_)->lane(DesignatorLane(designator));
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const int offset = DesignatorOffset(designator)
+    + plane_stride_ * (min_bit_plane - (kBitPlanes - stored_planes_));
+  if (packed_buffer_) {
+    SetPlaneBits(packed_buffer_ + offset, plane_stride_, min_bit_plane,
+                 lane, red, green, blue);
+  } else {
+    SetPlaneBits(bitplane_buffer_ + offset, plane_stride_, min_bit_plane,
+                 lane, red, green, blue);
+  }
+}
+
+// Bulk upload works on groups of pixels that are next to each other in
+// the bitplane buffer and share the same color bits (which is the case for
+// consecutive pixels of the same sub-panel, unless some pixel mapper
+// scrambled them). For these, the color values are transposed into bitplanes
+// several pixels at a time.
+enum { kTransposeGroup = 8 };
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline void TransposeToPlanes(const uint16_t *red, const uint16_t *green,
+                                     const uint16_t *blue,
+                                     const LaneBits &d,
+                                     int min_plane, int plane_stride,
+                                     gpio_bits_t *bits) {
+  const uint16x8_t r = vld1q_u16(red);
+  const uint16x8_t g = vld1q_u16(green);
+  const uint16x8_t b = vld1q_u16(blue);
+  const uint32x4_t r_bit = vdupq_n_u32(d.r_bit);
+  const uint32x4_t g_bit = vdupq_n_u32(d.g_bit);
+  const uint32x4_t b_bit = vdupq_n_u32(d.b_bit);
+  const uint32x4_t keep = vdupq_n_u32(d.mask);
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    const uint16x8_t m = vdupq_n_u16(1 << plane);
+    // Sign-extending the 16 bit all-ones/all-zero masks gives us 32 bit masks.
+    const int16x8_t r_on = vreinterpretq_s16_u16(vtstq_u16(r, m));
+    const int16x8_t g_on = vreinterpretq_s16_u16(vtstq_u16(g, m));
+    const int16x8_t b_on = vreinterpretq_s16_u16(vtstq_u16(b, m));
+    uint32x4_t lo = vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(r_on))), r_bit);
+    uint32x4_t hi = vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(r_on))), r_bit);
+    lo = vorrq_u32(lo, vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(g_on))), g_bit));
+    hi = vorrq_u32(hi, vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(g_on))), g_bit));
+    lo = vorrq_u32(lo, vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_low_s16(b_on))), b_bit));
+    hi = vorrq_u32(hi, vandq_u32(vreinterpretq_u32_s32(vmovl_s16(vget_high_s16(b_on))), b_bit));
+    gpio_bits_t *out = bits + (plane - min_plane) * plane_stride;
+    vst1q_u32(out, vorrq_u32(vandq_u32(vld1q_u32(out), keep), lo));
+    vst1q_u32(out + 4, vorrq_u32(vandq_u32(vld1q_u32(out + 4), keep), hi));
+  }
+}
+static inline void TransposeToPlanes(const uint16_t *red, const uint16_t *green,
+                                     const uint16_t *blue,
+                                     const LaneBits &d,
+                                     int min_plane, int plane_stride,
+                                     uint8_t *bits) {
+  const uint16x8_t r = vld1q_u16(red);
+  const uint16x8_t g = vld1q_u16(green);
+  const uint16x8_t b = vld1q_u16(blue);
+  const uint8x8_t r_bit = vdup_n_u8(d.r_bit);
+  const uint8x8_t g_bit = vdup_n_u8(d.g_bit);
+  const uint8x8_t b_bit = vdup_n_u8(d.b_bit);
+  const uint8x8_t keep = vdup_n_u8(d.mask);
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    const uint16x8_t m = vdupq_n_u16(1 << plane);
+    // Narrowing the 16 bit all-ones/all-zero masks gives us 8 bit masks.
+    uint8x8_t color = vand_u8(vmovn_u16(vtstq_u16(r, m)), r_bit);
+    color = vorr_u8(color, vand_u8(vmovn_u16(vtstq_u16(g, m)), g_bit));
+    color = vorr_u8(color, vand_u8(vmovn_u16(vtstq_u16(b, m)), b_bit));
+    uint8_t *out = bits + (plane - min_plane) * plane_stride;
+    vst1_u8(out, vorr_u8(vand_u8(vld1_u8(out), keep), color));
+  }
+}
+#elif defined(__SSE2__)
+static inline void TransposeToPlanes(const uint16_t *red, const uint16_t *green,
+                                     const uint16_t *blue,
+                                     const LaneBits &d,
+                                     int min_plane, int plane_stride,
+                                     gpio_bits_t *bits) {
+  const __m128i r = _mm_loadu_si128((const __m128i*) red);
+  const __m128i g = _mm_loadu_si128((const __m128i*) green);
+  const __m128i b = _mm_loadu_si128((const __m128i*) blue);
+  const __m128i r_bit = _mm_set1_epi32(d.r_bit);
+  const __m128i g_bit = _mm_set1_epi32(d.g_bit);
+  const __m128i b_bit = _mm_set1_epi32(d.b_bit);
+  const __m128i keep = _mm_set1_epi32(d.mask);
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    const __m128i m = _mm_set1_epi16(1 << plane);
+    const __m128i r_on = _mm_cmpeq_epi16(_mm_and_si128(r, m), m);
+    const __m128i g_on = _mm_cmpeq_epi16(_mm_and_si128(g, m), m);
+    const __m128i b_on = _mm_cmpeq_epi16(_mm_and_si128(b, m), m);
+    // Interleaving the 16 bit masks with themselves widens them to 32 bit.
+    __m128i lo = _mm_and_si128(_mm_unpacklo_epi16(r_on, r_on), r_bit);
+    __m128i hi = _mm_and_si128(_mm_unpackhi_epi16(r_on, r_on), r_bit);
+    lo = _mm_or_si128(lo, _mm_and_si128(_mm_unpacklo_epi16(g_on, g_on), g_bit));
+    hi = _mm_or_si128(hi, _mm_and_si128(_mm_unpackhi_epi16(g_on, g_on), g_bit));
+    lo = _mm_or_si128(lo, _mm_and_si128(_mm_unpacklo_epi16(b_on, b_on), b_bit));
+    hi = _mm_or_si128(hi, _mm_and_si128(_mm_unpackhi_epi16(b_on, b_on), b_bit));
+    __m128i *out = (__m128i*) (bits + (plane - min_plane) * plane_stride);
+    _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(out), keep), lo));
+    _mm_storeu_si128(out + 1, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(out + 1), keep), hi));
+  }
+}
+static inline void TransposeToPlanes(const uint16_t *red, const uint16_t *green,
+                                     const uint16_t *blue,
+                                     const LaneBits &d,
+                                     int min_plane, int plane_stride,
+                                     uint8_t *bits) {
+  const __m128i r = _mm_loadu_si128((const __m128i*) red);
+  const __m128i g = _mm_loadu_si128((const __m128i*) green);
+  const __m128i b = _mm_loadu_si128((const __m128i*) blue);
+  const __m128i r_bit = _mm_set1_epi8(d.r_bit);
+  const __m128i g_bit = _mm_set1_epi8(d.g_bit);
+  const __m128i b_bit = _mm_set1_epi8(d.b_bit);
+  const __m128i keep = _mm_set1_epi8(d.mask);
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    const __m128i m = _mm_set1_epi16(1 << plane);
+    // Saturating packing of the 16 bit masks gives us 8 bit masks.
+    const __m128i r_on = _mm_cmpeq_epi16(_mm_and_si128(r, m), m);
+    const __m128i g_on = _mm_cmpeq_epi16(_mm_and_si128(g, m), m);
+    const __m128i b_on = _mm_cmpeq_epi16(_mm_and_si128(b, m), m);
+    __m128i color = _mm_and_si128(_mm_packs_epi16(r_on, r_on), r_bit);
+    color = _mm_or_si128(color, _mm_and_si128(_mm_packs_epi16(g_on, g_on), g_bit));
+    color = _mm_or_si128(color, _mm_and_si128(_mm_packs_epi16(b_on, b_on), b_bit));
+    __m128i *out = (__m128i*) (bits + (plane - min_plane) * plane_stride);
+    _mm_storel_epi64(out, _mm_or_si128(_mm_and_si128(_mm_loadl_epi64(out), keep), color));
+  }
+}
+#endif
+
+// Portable version.
+template <typename T>
+static inline void TransposeToPlanes(const uint16_t *red, const uint16_t *green,
+                                     const uint16_t *blue,
+                                     const LaneBits &d,
+                                     int min_plane, int plane_stride,
+                                     T *bits) {
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    T *out = bits + (plane - min_plane) * plane_stride;
+    for (int i = 0; i < kTransposeGroup; ++i) {
+      // Branch-free: a set bit becomes an all-ones mask.
+      const uint32_t color_bits
+        = (d.r_bit & -(uint32_t)((red[i] >> plane) & 1))
+        | (d.g_bit & -(uint32_t)((green[i] >> plane) & 1))
+        | (d.b_bit & -(uint32_t)((blue[i] >> plane) & 1));
+      out[i] = (out[i] & d.mask) | color_bits;
+    }
+  }
+}
+
+// Set "count" pixels of a run, starting at "bits" in plane "min_plane".
+// Returns the bitplanes of all colors set.
+template <typename T>
+inline uint16_t Framebuffer::SetRunPixels(T *bits, const LaneBits &lane,
+                                          int min_plane, const uint8_t *pixel,
+                                          int count) {
+  uint16_t red[kTransposeGroup], green[kTransposeGroup], blue[kTransposeGroup];
+  uint16_t planes = 0;
+  int i = 0;
+  for (/**/; i + kTransposeGroup <= count; i += kTransposeGroup) {
+    for (int j = 0; j < kTransposeGroup; ++j, pixel += 3) {
+      MapColors(pixel[0], pixel[1], pixel[2], &red[j], &green[j], &blue[j]);
+      planes |= red[j] | green[j] | blue[j];
+    }
+    TransposeToPlanes(red, green, blue, lane, min_plane, plane_stride_,
+                      bits + i);
+  }
+  for (/**/; i < count; ++i, pixel += 3) {
+    MapColors(pixel[0], pixel[1], pixel[2], &red[0], &green[0], &blue[0]);
+    planes |= red[0] | green[0] | blue[0];
+    SetPlaneBits(bits + i, plane_stride_, min_plane, lane,
+                 red[0], green[0], blue[0]);
+  }
+  return planes;
+}
+
+void Framebuffer::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb, int stride) {
+  const PixelDesignatorMap *const mapper = *shared_mapper_;
+  // Clip to the visible area.
+  int x_start = std::max(0, -x);
+  int x_end = std::min(width, mapper->width() - x);
+  int y_start = std::max(0, -y);
+  int y_end = std::min(height, mapper->height() - y);
+  if (x_start >= x_end || y_start >= y_end) return;
+
+  const int min_plane = kBitPlanes - pwm_bits_;
+  const int plane_offset = plane_stride_ * (min_plane
+                                            - (kBitPlanes - stored_planes_));
+  const int first_col = x + x_start;
+  const int last_col = x + x_end;  // exclusive.
+  for (int row = y_start; row < y_end; ++row) {
+    // Column "col" of the canvas is pixel "col - x" of the input row.
+    const uint8_t *const pixels = rgb + row * stride;
+    const PixelDesignator *const designators = mapper->get(0, y + row);
+    const PixelRun *run = mapper->row_runs_begin(y + row);
+    const PixelRun *const runs_end = mapper->row_runs_end(y + row);
+    int col = first_col;
+    while (col < last_col) {
+      while (run != runs_end && run->x + run->length <= col) ++run;
+      // Pixels before the next run are set one by one.
+      const int single_end = (run != runs_end)
+        ? std::min(std::max(run->x, col), last_col) : last_col;
+      for (/**/; col < single_end; ++col) {
+        const PixelDesignator d = designators[col];
+        if (d == kUnusedPixel) continue;
+        const uint8_t *pixel = pixels + 3 * (col - x);
+        uint16_t red, green, blue;
+        MapColors(pixel[0], pixel[1], pixel[2], &red, &green, &blue);
+        SetPixelBits(d, red, green, blue);
+        MarkModified(DesignatorOffset(d), red | green | blue);
+      }
+      if (col >= last_col) break;
+
+      const int count = std::min(run->x + run->length, last_col) - col;
+      const int offset = DesignatorOffset(run->first) + (col - run->x);
+      const LaneBits &lane = mapper->lane(DesignatorLane(run->first));
+      uint16_t planes;
+      if (packed_buffer_) {
+        planes = SetRunPixels(packed_buffer_ + offset + plane_offset, lane,
+                              min_plane, pixels + 3 * (col - x), count);
+      } else {
+        planes = SetRunPixels(bitplane_buffer_ + offset + plane_offset, lane,
+                              min_plane, pixels + 3 * (col - x), count);
+      }
+      MarkModified(offset, planes);
+      col += count;
+    }
+  }
+}
+
+// Fill "count" elements of a run, starting at "bits" in plane "min_plane".
+template <typename T>
+static inline void FillRun(T *bits, int plane_stride, int min_plane,
+                           const LaneBits &lane, int count,
+                           uint16_t red, uint16_t green, uint16_t blue) {
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    const uint32_t color_bits = (((red >> plane) & 1) ? lane.r_bit : 0)
+      | (((green >> plane) & 1) ? lane.g_bit : 0)
+      | (((blue >> plane) & 1) ? lane.b_bit : 0);
+    const T keep = lane.mask;
+    const T set = color_bits;
+    for (int i = 0; i < count; ++i) {
+      bits[i] = (bits[i] & keep) | set;
+    }
+    bits += plane_stride;
+  }
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  const PixelDesignatorMap *const mapper = *shared_mapper_;
+  const int first_col = std::max(0, x);
+  const int last_col = std::min(x + width, mapper->width());
+  const int first_row = std::max(0, y);
+  const int last_row = std::min(y + height, mapper->height());
+  if (first_col >= last_col || first_row >= last_row) return;
+
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  const int min_plane = kBitPlanes - pwm_bits_;
+  const int plane_offset = plane_stride_ * (min_plane
+                                            - (kBitPlanes - stored_planes_));
+  for (int row = first_row; row < last_row; ++row) {
+    const PixelDesignator *const designators = mapper->get(0, row);
+    const PixelRun *run = mapper->row_runs_begin(row);
+    const PixelRun *const runs_end = mapper->row_runs_end(row);
+    int col = first_col;
+    while (col < last_col) {
+      while (run != runs_end && run->x + run->length <= col) ++run;
+      const int single_end = (run != runs_end)
+        ? std::min(std::max(run->x, col), last_col) : last_col;
+      for (/**/; col < single_end; ++col) {
+        const PixelDesignator d = designators[col];
+        if (d == kUnusedPixel) continue;
+        SetPixelBits(d, red, green, blue);
+        MarkModified(DesignatorOffset(d), red | green | blue);
+      }
+      if (col >= last_col) break;
+
+      const int count = std::min(run->x + run->length, last_col) - col;
+      const int offset = DesignatorOffset(run->first) + (col - run->x);
+      const LaneBits &lane = mapper->lane(DesignatorLane(run->first));
+      if (packed_buffer_) {
+        FillRun(packed_buffer_ + offset + plane_offset, plane_stride_,
+                min_plane, lane, count, red, green, blue);
+      } else {
+        FillRun(bitplane_buffer_ + offset + plane_offset, plane_stride_,
+                min_plane, lane, count, red, green, blue);
+      }
+      MarkModified(offset, red | green | blue);
+      col += count;
+    }
+  }
+}
+
+// Copy "count" elements of a run in all "planes" stored bitplanes to a run
+// with the same color bits; the other bits of the destination are kept.
+template <typename T>
+static inline void BlitRun(const T *from, int from_stride,
+                           T *to, int to_stride, int planes,
+                           const LaneBits &lane, int count) {
+  const T keep = lane.mask;
+  const T take = ~lane.mask;
+  for (int p = 0; p < planes; ++p) {
+    for (int i = 0; i < count; ++i) {
+      to[i] = (to[i] & keep) | (from[i] & take);
+    }
+    from += from_stride;
+    to += to_stride;
+  }
+}
+
+// Move the color bits of a single pixel in all "planes" stored bitplanes
+// from the bits of lane "from_lane" to the ones of "to_lane".
+template <typename T>
+static inline void BlitPixel(const T *from, int from_stride,
+                             const LaneBits &from_lane,
+                             T *to, int to_stride, const LaneBits &to_lane,
+                             int planes) {
+  for (int p = 0; p < planes; ++p) {
+    const uint32_t value = *from;
+    const uint32_t color_bits = ((value & from_lane.r_bit) ? to_lane.r_bit : 0)
+      | ((value & from_lane.g_bit) ? to_lane.g_bit : 0)
+      | ((value & from_lane.b_bit) ? to_lane.b_bit : 0);
+    *to = (*to & to_lane.mask) | color_bits;
+    from += from_stride;
+    to += to_stride;
+  }
+}
+
+static inline bool SameColorBits(const LaneBits &a, const LaneBits &b) {
+  return a.r_bit == b.r_bit && a.g_bit == b.g_bit && a.b_bit == b.b_bit;
+}
+
+void Framebuffer::BlitFrom(const Framebuffer &src, int sx, int sy,
+                           int width, int height, int dx, int dy) {
+  assert(packed() == src.packed() && stored_planes_ == src.stored_planes_);
+  const PixelDesignatorMap *const from_map = *src.shared_mapper_;
+  const PixelDesignatorMap *const to_map = *shared_mapper_;
+
+  // Clip to both canvases.
+  if (sx < 0) { width += sx; dx -= sx; sx = 0; }
+  if (sy < 0) { height += sy; dy -= sy; sy = 0; }
+  if (dx < 0) { width += dx; sx -= dx; dx = 0; }
+  if (dy < 0) { height += dy; sy -= dy; dy = 0; }
+  width = std::min(width, std::min(from_map->width() - sx,
+                                   to_map->width() - dx));
+  height = std::min(height, std::min(from_map->height() - sy,
+                                     to_map->height() - dy));
+  if (width <= 0 || height <= 0) return;
+
+  // The whole canvas onto one with the same layout: plain copy.
+  if (&src != this && from_map == to_map && sx == 0 && sy == 0
+      && dx == 0 && dy == 0
+      && width == to_map->width() && height == to_map->height()) {
+    memcpy(RawBuffer(), src.RawBuffer(), buffer_size_);
+    memcpy(used_planes_, src.used_planes_, double_rows_ * sizeof(uint16_t));
+    MarkAllModified();
+    return;
+  }
+
+  const int from_row_size = src.plane_stride_ * src.stored_planes_;
+  // Within the same canvas, overlapping areas are copied one pixel at a time
+  // in the direction that reads every pixel before it is overwritten.
+  const bool overlap = (&src == this)
+    && abs(sx - dx) < width && abs(sy - dy) < height;
+  const bool backward_y = overlap && dy > sy;
+  const bool backward_x = overlap && dx > sx;
+  for (int i = 0; i < height; ++i) {
+    const int row = backward_y ? height - 1 - i : i;
+    const PixelDesignator *const from_designators = from_map->get(sx, sy + row);
+    const PixelDesignator *const to_designators = to_map->get(dx, dy + row);
+    const PixelRun *from_run = from_map->row_runs_begin(sy + row);
+    const PixelRun *const from_runs_end = from_map->row_runs_end(sy + row);
+    const PixelRun *to_run = to_map->row_runs_begin(dy + row);
+    const PixelRun *const to_runs_end = to_map->row_runs_end(dy + row);
+    int col = 0;
+    while (col < width) {
+      const int c = backward_x ? width - 1 - col : col;
+      if (!overlap) {
+        // Where both are in a run with the same color bits, whole runs of
+        // elements can be copied without looking at the individual colors.
+        while (from_run != from_runs_end
+               && from_run->x + from_run->length <= sx + c) ++from_run;
+        while (to_run != to_runs_end
+               && to_run->x + to_run->length <= dx + c) ++to_run;
+        if (from_run != from_runs_end && from_run->x <= sx + c
+            && to_run != to_runs_end && to_run->x <= dx + c) {
+          const LaneBits &lane = to_map->lane(DesignatorLane(to_run->first));
+          if (SameColorBits(from_map->lane(DesignatorLane(from_run->first)),
+                            lane)) {
+            const int count
+              = std::min(std::min(from_run->x + from_run->length - (sx + c),
+                                  to_run->x + to_run->length - (dx + c)),
+                         width - c);
+            const int from_offset = DesignatorOffset(from_run->first)
+              + (sx + c - from_run->x);
+            const int to_offset = DesignatorOffset(to_run->first)
+              + (dx + c - to_run->x);
+            if (packed_buffer_) {
+              BlitRun(src.packed_buffer_ + from_offset, src.plane_stride_,
+                      packed_buffer_ + to_offset, plane_stride_,
+                      stored_planes_, lane, count);
+            } else {
+              BlitRun(src.bitplane_buffer_ + from_offset, src.plane_stride_,
+                      bitplane_buffer_ + to_offset, plane_stride_,
+                      stored_planes_, lane, count);
+            }
+            MarkModified(to_offset,
+                         src.used_planes_[from_offset / from_row_size]);
+            col += count;
+            continue;
+          }
+        }
+      }
+
+      const PixelDesignator from = from_designators[c];
+      const PixelDesignator to = to_designators[c];
+      ++col;
+      if (from == kUnusedPixel || to == kUnusedPixel) continue;
+      const LaneBits &from_lane = from_map->lane(DesignatorLane(from));
+      const LaneBits &to_lane = to_map->lane(DesignatorLane(to));
+      const int from_offset = DesignatorOffset(from);
+      const int to_offset = DesignatorOffset(to);
+      if (packed_buffer_) {
+        BlitPixel(src.packed_buffer_ + from_offset, src.plane_stride_,
+                  from_lane, packed_buffer_ + to_offset, plane_stride_,
+                  to_lane, stored_planes_);
+      } else {
+        BlitPixel(src.bitplane_buffer_ + from_offset, src.plane_stride_,
+                  from_lane, bitplane_buffer_ + to_offset, plane_stride_,
+                  to_lane, stored_planes_);
+      }
+      MarkModified(to_offset, src.used_planes_[from_offset / from_row_size]);
+    }
+  }
+}
+
+// Gather the bits of "count" (up to kTransposeGroup) pixels of a run in all
+// planes starting with "min_plane"; "bits" points to the first element in
+// that plane.
+template <typename T>
+static inline void GetRunBits(const T *bits, int plane_stride, int min_plane,
+                              const LaneBits &lane, int count,
+                              uint16_t *red, uint16_t *green, uint16_t *blue) {
+  // Each color is a single bit of the lane; shift it down to bit 0.
+  const int r_shift = __builtin_ctz(lane.r_bit);
+  const int g_shift = __builtin_ctz(lane.g_bit);
+  const int b_shift = __builtin_ctz(lane.b_bit);
+  for (int i = 0; i < count; ++i) {
+    red[i] = green[i] = blue[i] = 0;
+  }
+  for (int plane = min_plane; plane < kBitPlanes; ++plane) {
+    for (int i = 0; i < count; ++i) {
+      const uint32_t value = bits[i];
+      red[i] |= ((value >> r_shift) & 1) << plane;
+      green[i] |= ((value >> g_shift) & 1) << plane;
+      blue[i] |= ((value >> b_shift) & 1) << plane;
+    }
+    bits += plane_stride;
+  }
+}
+
+void Framebuffer::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) const {
+  *red = *green = *blue = 0;
+  const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
+  if (designator == NULL) return;
+  if (*designator == kUnusedPixel) return;
+
+  const LaneBits &lane = (*shared_mapper_)->lane(DesignatorLane(*designator));
+  const int min_plane = kBitPlanes - pwm_bits_;
+  const int offset = DesignatorOffset(*designator)
+    + plane_stride_ * (min_plane - (kBitPlanes - stored_planes_));
+  uint16_t r, g, b;
+  if (packed_buffer_) {
+    GetRunBits(packed_buffer_ + offset, plane_stride_, min_plane, lane, 1,
+               &r, &g, &b);
+  } else {
+    GetRunBits(bitplane_buffer_ + offset, plane_stride_, min_plane, lane, 1,
+               &r, &g, &b);
+  }
+  uint8_t pixel[3];
+  UnmapColors(r, g, b, pixel);
+  *red = pixel[0];
+  *green = pixel[1];
+  *blue = pixel[2];
+}
+
+void Framebuffer::GetPixels(int x, int y, int width, int height,
+                            uint8_t *rgb, int stride) const {
+  const PixelDesignatorMap *const mapper = *shared_mapper_;
+  // Clip to the visible area.
+  int x_start = std::max(0, -x);
+  int x_end = std::min(width, mapper->width() - x);
+  int y_start = std::max(0, -y);
+  int y_end = std::min(height, mapper->height() - y);
+  if (x_start >= x_end || y_start >= y_end) return;
+
+  const int min_plane = kBitPlanes - pwm_bits_;
+  const int plane_offset = plane_stride_ * (min_plane
+                                            - (kBitPlanes - stored_planes_));
+  const int first_col = x + x_start;
+  const int last_col = x + x_end;  // exclusive.
+  uint16_t red[kTransposeGroup], green[kTransposeGroup], blue[kTransposeGroup];
+  for (int row = y_start; row < y_end; ++row) {
+    // Column "col" of the canvas is pixel "col - x" of the output row.
+    uint8_t *const pixels = rgb + row * stride;
+    const PixelRun *run = mapper->row_runs_begin(y + row);
+    const PixelRun *const runs_end = mapper->row_runs_end(y + row);
+    int col = first_col;
+    while (col < last_col) {
+      while (run != runs_end && run->x + run->length <= col) ++run;
+      // Pixels before the next run are read one by one.
+      const int single_end = (run != runs_end)
+        ? std::min(std::max(run->x, col), last_col) : last_col;
+      for (/**/; col < single_end; ++col) {
+        uint8_t *const pixel = pixels + 3 * (col - x);
+        GetPixel(col, y + row, &pixel[0], &pixel[1], &pixel[2]);
+      }
+      if (col >= last_col) break;
+
+      const int count = std::min(run->x + run->length, last_col) - col;
+      const int offset = DesignatorOffset(run->first) + (col - run->x)
+        + plane_offset;
+      const LaneBits &lane = mapper->lane(DesignatorLane(run->first));
+      for (int i = 0; i < count; i += kTransposeGroup) {
+        // Full groups with a constant count, so that the compiler can
+        // unroll them.
+        const int n = std::min((int)kTransposeGroup, count - i);
+        if (packed_buffer_) {
+          if (n == kTransposeGroup) {
+            GetRunBits(packed_buffer_ + offset + i, plane_stride_, min_plane,
+                       lane, kTransposeGroup, red, green, blue);
+          } else {
+            GetRunBits(packed_buffer_ + offset + i, plane_stride_, min_plane,
+                       lane, n, red, green, blue);
+          }
+        } else {
+          if (n == kTransposeGroup) {
+            GetRunBits(bitplane_buffer_ + offset + i, plane_stride_,
+                       min_plane, lane, kTransposeGroup, red, green, blue);
+          } else {
+            GetRunBits(bitplane_buffer_ + offset + i, plane_stride_,
+                       min_plane, lane, n, red, green, blue);
+          }
+        }
+        for (int j = 0; j < n; ++j) {
+          UnmapColors(red[j], green[j], blue[j],
+                      pixels + 3 * (col + i + j - x));
+        }
+      }
+      col += count;
+    }
   }
 }
 
@@ -501,11 +1504,27 @@ gpio_bits_t Framebuffer::GetGpioFromLedSequence(char col,
 }
 
 void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
-                                        PixelDesignator *d) {
+                                        PixelDesignator *designator) {
+  LaneBits lane;
+  LaneBits *const d = &lane;
+  int gpio_word;
+  if (packed_buffer_) {
+    // One byte per chain, the lower sub-panel in the upper three bits.
+    const int chain = y / rows_;
+    const int shift = (y % rows_ < double_rows_) ? 0 : 3;
+    gpio_word = IndexAt(y % double_rows_, x, kBitPlanes - stored_planes_)
+      + chain * columns_;
+    const uint32_t r = 0x01 << shift, g = 0x02 << shift, b = 0x04 << shift;
+    d->r_bit = GetGpioFromLedSequence('R', seq, r, g, b);
+    d->g_bit = GetGpioFromLedSequence('G', seq, r, g, b);
+    d->b_bit = GetGpioFromLedSequence('B', seq, r, g, b);
+    d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+    *designator = MakeDesignator(gpio_word, (*shared_mapper_)->AddLane(lane));
+    return;
+  }
+
   const struct HardwareMapping &h = *hardware_mapping_;
-  uint32_t *bits = ValueAt(y % double_rows_, x, 0);
-  d->gpio_word = bits - bitplane_buffer_;
-  d->r_bit = d->g_bit = d->b_bit = 0;
+  gpio_word = IndexAt(y % double_rows_, x, kBitPlanes - stored_planes_);
   if (y < rows_) {
     if (y < double_rows_) {
       d->r_bit = GetGpioFromLedSequence('R', seq, h.p0_r1, h.p0_g1, h.p0_b1);
@@ -541,44 +1560,208 @@ void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
   }
 
   d->mask = ~(d->r_bit | d->g_bit | d->b_bit);
+  *designator = MakeDesignator(gpio_word, (*shared_mapper_)->AddLane(lane));
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
-  *data = reinterpret_cast<const char*>(bitplane_buffer_);
+  *data = RawBuffer();
   *len = buffer_size_;
 }
 
 bool Framebuffer::Deserialize(const char *data, size_t len) {
-  if (len != buffer_size_) return false;
-  memcpy(bitplane_buffer_, data, len);
+  // The data might come from a Framebuffer that stores a different number of
+  // bitplanes. We take the upper planes we have in common and clear the
+  // ones the data does not have.
+  const size_t element_size = packed_buffer_ ? 1 : sizeof(gpio_bits_t);
+  const size_t plane_size = plane_stride_ * element_size;
+  if (len % (double_rows_ * plane_size) != 0) return false;
+  const int data_planes = len / (double_rows_ * plane_size);
+  if (data_planes < 1 || data_planes > kBitPlanes) return false;
+
+  // Only rows that actually differ are copied and marked as modified.
+  for (int row = 0; row < double_rows_; ++row) {
+    bool modified = false;
+    for (int b = kBitPlanes - stored_planes_; b < kBitPlanes; ++b) {
+      char *plane = RawBuffer() + IndexAt(row, 0, b) * element_size;
+      const int data_plane = b - (kBitPlanes - data_planes);
+      if (data_plane < 0) {
+        if (plane[0] != 0 || memcmp(plane, plane + 1, plane_size - 1) != 0) {
+          memset(plane, 0, plane_size);
+          modified = true;
+        }
+        continue;
+      }
+      const char *from = data + (row * data_planes + data_plane) * plane_size;
+      if (memcmp(plane, from, plane_size) != 0) {
+        memcpy(plane, from, plane_size);
+        modified = true;
+      }
+    }
+    if (modified) {
+      unversioned_rows_ |= 1ULL << row;
+      UpdateUsedPlanes(row);
+      scan_stream_valid_.store(false, std::memory_order_relaxed);
+    }
+  }
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
-  memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  // A scroll canvas and a regular one of the same matrix differ in size.
+  if (columns_ != other->columns_ || buffer_size_ != other->buffer_size_)
+    return;
+  // Only copy rows whose content is not the same already.
+  UpdateRowVersions();
+  other->UpdateRowVersions();
+  const size_t row_size = buffer_size_ / double_rows_;
+  char *buffer = RawBuffer();
+  const char *other_buffer = other->RawBuffer();
+  for (int row = 0; row < double_rows_; ++row) {
+    if (row_version_[row] == other->row_version_[row]) continue;
+    memcpy(buffer + row * row_size, other_buffer + row * row_size, row_size);
+    row_version_[row] = other->row_version_[row];
+    used_planes_[row] = other->used_planes_[row];
+    dirty_rows_ |= 1ULL << row;
+    scan_stream_valid_.store(false, std::memory_order_relaxed);
+  }
+  scroll_offset_.store(other->scroll_offset(), std::memory_order_relaxed);
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
-  const struct HardwareMapping &h = *hardware_mapping_;
-  gpio_bits_t color_clk_mask = 0;  // Mask of bits while clocking in.
+void Framebuffer::SetScrollOffset(int column) {
+  // Moving the offset of a canvas not wider than the display would only
+  // rotate what is shown.
+  if (columns_ <= shown_columns_) return;
+  column %= columns_;
+  if (column < 0) column += columns_;
+  scroll_offset_.store(column, std::memory_order_relaxed);
+}
+
+static inline uint64_t NanosecondTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Mask of the bits written while clocking in the colors.
+static gpio_bits_t ColorClockMask(const HardwareMapping &h, int parallel) {
+  gpio_bits_t color_clk_mask = 0;
   color_clk_mask |= h.p0_r1 | h.p0_g1 | h.p0_b1 | h.p0_r2 | h.p0_g2 | h.p0_b2;
-  if (parallel_ >= 2) {
+  if (parallel >= 2) {
     color_clk_mask |= h.p1_r1 | h.p1_g1 | h.p1_b1 | h.p1_r2 | h.p1_g2 | h.p1_b2;
   }
-  if (parallel_ >= 3) {
+  if (parallel >= 3) {
     color_clk_mask |= h.p2_r1 | h.p2_g1 | h.p2_b1 | h.p2_r2 | h.p2_g2 | h.p2_b2;
   }
+  return color_clk_mask | h.clock;
+}
+
+void Framebuffer::CompileScanStream() {
+  const gpio_bits_t color_clk_mask = ColorClockMask(*hardware_mapping_,
+                                                    parallel_);
+  if (scan_stream_ == NULL) {
+    scan_stream_ = new gpio_bits_t[2 * double_rows_ * stored_planes_
+                                   * columns_];
+    // Framebuffer ids are never 0, so all rows get compiled.
+    scan_stream_version_ = new RowVersion[double_rows_];
+  }
+  for (int row = 0; row < double_rows_; ++row) {
+    const RowVersion version = row_version(row);
+    if (scan_stream_version_[row] == version) continue;
+    for (int b = kBitPlanes - stored_planes_; b < kBitPlanes; ++b) {
+      gpio_bits_t *stream = ScanStreamAt(row, b);
+      for (int col = 0; col < columns_; ++col) {
+        gpio_bits_t out;
+        if (packed_buffer_) {
+          const uint8_t *chain = PackedAt(row, col, b);
+          out = sPackedToGpio[0][chain[0]];
+          if (parallel_ >= 2) out |= sPackedToGpio[1][chain[columns_]];
+          if (parallel_ >= 3) out |= sPackedToGpio[2][chain[2 * columns_]];
+        } else {
+          out = *ValueAt(row, col, b);
+        }
+        // Same as io->WriteMaskedBits(out, color_clk_mask).
+        *stream++ = ~out & color_clk_mask;
+        *stream++ = out & color_clk_mask;
+      }
+    }
+    scan_stream_version_[row] = version;
+  }
+  scan_stream_valid_.store(true, std::memory_order_release);
+}
+
+// Clock in the columns [begin, end) of a bitplane. The shown columns start
+// at the scroll offset and wrap around, so each bitplane is sent with up to
+// two of these calls.
+static inline void ClockInStream(GPIO *io, const gpio_bits_t *stream,
+                                 int begin, int end, gpio_bits_t clock) {
+  // Everything precomputed, just send it out.
+  for (int col = begin; col < end; ++col) {
+    io->ClearBits(stream[2 * col]);     // col + reset clock
+    io->SetBits(stream[2 * col + 1]);
+    io->SetBits(clock);                 // Rising edge: clock color in.
+  }
+}
+
+template <int kParallel>
+static inline void ClockInPacked(GPIO *io, const uint8_t *chain0, int columns,
+                                 int begin, int end,
+                                 gpio_bits_t color_clk_mask,
+                                 gpio_bits_t clock) {
+  // Expand the color bits of each chain to their GPIO bits.
+  const uint8_t *const chain1 = chain0 + columns;
+  const uint8_t *const chain2 = chain1 + columns;
+  for (int col = begin; col < end; ++col) {
+    gpio_bits_t out = sPackedToGpio[0][chain0[col]];
+    if (kParallel >= 2) out |= sPackedToGpio[1][chain1[col]];
+    if (kParallel >= 3) out |= sPackedToGpio[2][chain2[col]];
+    io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
+    io->SetBits(clock);                 // Rising edge: clock color in.
+  }
+}
+
+static inline void ClockInUnpacked(GPIO *io, const gpio_bits_t *row_data,
+                                   int begin, int end,
+                                   gpio_bits_t color_clk_mask,
+                                   gpio_bits_t clock) {
+  for (int col = begin; col < end; ++col) {
+    io->WriteMaskedBits(row_data[col], color_clk_mask);  // col + reset clock
+    io->SetBits(clock);                 // Rising edge: clock color in.
+  }
+}
+
+void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit,
+                               RefreshTiming *timing) {
+  (this->*scan_out_[scan_mode_ == 1 ? 1 : 0])(io, pwm_low_bit, timing);
+}
 
-  color_clk_mask |= h.clock;
+template <int kParallel, int kScanMode, class RowSetter>
+void Framebuffer::ScanOut(GPIO *io, int pwm_low_bit, RefreshTiming *timing) {
+  const struct HardwareMapping &h = *hardware_mapping_;
+  // Mask of bits while clocking in.
+  const gpio_bits_t color_clk_mask = ColorClockMask(h, kParallel);
+  const bool use_stream
+    = scan_stream_valid_.load(std::memory_order_acquire);
+
+  // The shown columns: from the scroll offset to the end of the stored
+  // columns, then wrapping around to the beginning.
+  const int first_col = scroll_offset_.load(std::memory_order_relaxed);
+  const int first_end = std::min(columns_, first_col + shown_columns_);
+  const int wrapped_end = shown_columns_ - (first_end - first_col);
 
   // Depending if we do dithering, we might not always show the lowest bits.
   const int start_bit = std::max(pwm_low_bit, kBitPlanes - pwm_bits_);
 
+  // Planes without any LED on don't need to be clocked in; with inverse
+  // colors, set bits are the ones that are off, so we can't tell.
+  const bool skip_blank = sSkipBlankPlanes && !inverse_color_;
+  const uint16_t shown_planes = (1 << kBitPlanes) - (1 << start_bit);
+
+  RowSetter *const row_setter = static_cast<RowSetter*>(row_setter_);
   const uint8_t half_double = double_rows_/2;
   for (uint8_t row_loop = 0; row_loop < double_rows_; ++row_loop) {
     uint8_t d_row;
-    switch (scan_mode_) {
+    switch (kScanMode) {
     case 0:  // progressive
     default:
       d_row = row_loop;
@@ -590,32 +1773,73 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
                : ((row_loop - half_double) << 1) + 1);
     }
 
+    const uint16_t row_planes = skip_blank
+      ? used_planes_[d_row] & shown_planes : shown_planes;
+
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
     for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+      if ((row_planes & (1 << b)) == 0) {
+        // Nothing to clock in, but the plane keeps its time, dark, so that
+        // the frame period doesn't depend on the content. The address is
+        // set for the row anyway, as the row of the following planes.
+        sOutputEnablePulser->WaitPulseFinished();
+        row_setter->RowSetter::SetRowAddress(io, d_row);
+        sOutputEnablePulser->SendDarkPulse(b);
+        continue;
+      }
+
+      const uint64_t clock_start = timing ? NanosecondTime() : 0;
+
       // While the output enable is still on, we can already clock in the next
       // data.
-      for (int col = 0; col < columns_; ++col) {
-        const gpio_bits_t &out = *row_data++;
-        io->WriteMaskedBits(out, color_clk_mask);  // col + reset clock
-        io->SetBits(h.clock);               // Rising edge: clock color in.
+      if (use_stream) {
+        const gpio_bits_t *stream = ScanStreamAt(d_row, b);
+        ClockInStream(io, stream, first_col, first_end, h.clock);
+        ClockInStream(io, stream, 0, wrapped_end, h.clock);
+      } else if (packed_buffer_) {
+        const uint8_t *chain0 = PackedAt(d_row, 0, b);
+        ClockInPacked<kParallel>(io, chain0, columns_, first_col, first_end,
+                                 color_clk_mask, h.clock);
+        ClockInPacked<kParallel>(io, chain0, columns_, 0, wrapped_end,
+                                 color_clk_mask, h.clock);
+      } else {
+        const gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+        ClockInUnpacked(io, row_data, first_col, first_end,
+                        color_clk_mask, h.clock);
+        ClockInUnpacked(io, row_data, 0, wrapped_end,
+                        color_clk_mask, h.clock);
       }
       io->ClearBits(color_clk_mask);    // clock back to normal.
+      const uint64_t wait_start = timing ? NanosecondTime() : 0;
 
       // OE of the previous row-data must be finished before strobe.
       sOutputEnablePulser->WaitPulseFinished();
+      const uint64_t row_start = timing ? NanosecondTime() : 0;
 
-      // Setting address and strobing needs to happen in dark time.
-      row_setter_->SetRowAddress(io, d_row);
+      // Setting address and strobing needs to happen in dark time. The
+      // qualified call does not need to go through the vtable.
+      row_setter->RowSetter::SetRowAddress(io, d_row);
 
       io->SetBits(h.strobe);   // Strobe in the previously clocked in row.
       io->ClearBits(h.strobe);
 
+      if (timing) {
+        uint64_t *ns = timing->nanoseconds[d_row][b];
+        ns[RefreshTiming::CLOCK_IN] += wait_start - clock_start;
+        ns[RefreshTiming::WAIT_PULSE] += row_start - wait_start;
+        ns[RefreshTiming::ROW_SELECT] += NanosecondTime() - row_start;
+        timing->samples[d_row][b]++;
+      }
+
       // Now switch on for the sleep time necessary for that bit-plane.
       sOutputEnablePulser->SendPulse(b);
     }
   }
+  if (timing) {
+    timing->double_rows = double_rows_;
+    timing->frames++;
+  }
 }
 }  // namespace internal
 }  // namespace rgb_matrix
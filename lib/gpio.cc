@@ -27,6 +27,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 /*
  * nanosleep() takes longer than requested because of OS jitter.
  * In about 99.9% of the cases, this is <= 25 microcseconds on
@@ -136,12 +138,18 @@ namespace rgb_matrix {
    (1 << 19) | (1 << 20) | (1 << 21) | (1 << 26)
 );
 
-GPIO::GPIO() : output_bits_(0), input_bits_(0), reserved_bits_(0),
-               slowdown_(1) {
+GPIO::GPIO() : backend_(NULL), output_bits_(0), input_bits_(0),
+               reserved_bits_(0), slowdown_(1) {
 }
 
 uint32_t GPIO::InitOutputs(uint32_t outputs,
                            bool adafruit_pwm_transition_hack_needed) {
+  if (backend_) {
+    outputs &= kValidBits;
+    outputs &= ~(output_bits_ | input_bits_ | reserved_bits_);
+    output_bits_ |= outputs;
+    return outputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init outputs but not yet Init()-ialized.\n");
     return 0;
@@ -178,6 +186,12 @@ uint32_t GPIO::InitOutputs(uint32_t outputs,
 }
 
 uint32_t GPIO::RequestInputs(uint32_t inputs) {
+  if (backend_) {
+    inputs &= kValidBits;
+    inputs &= ~(output_bits_ | input_bits_ | reserved_bits_);
+    input_bits_ |= inputs;
+    return inputs;
+  }
   if (s_GPIO_registers == NULL) {
     fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
     return 0;
@@ -344,6 +358,12 @@ bool GPIO::Init(int slowdown) {
   return true;
 }
 
+bool GPIO::Init(GPIOBackend *backend) {
+  if (backend == NULL) return false;
+  backend_ = backend;
+  return true;
+}
+
 /*
  * We support also other pinouts that don't have the OE- on the hardware
  * PWM output pin, so we need to provide (impefect) 'manual' timing as well.
@@ -365,7 +385,7 @@ class TimerBasedPinPulser : public PinPulser {
 public:
   TimerBasedPinPulser(GPIO *io, uint32_t bits,
                       const std::vector<int> &nano_specs)
-    : io_(io), bits_(bits), nano_specs_(nano_specs) {
+    : io_(io), bits_(bits), base_specs_(nano_specs), nano_specs_(nano_specs) {
     if (!s_Timer1Mhz) {
       fprintf(stderr, "FYI: not running as root which means we can't properly "
               "control timing unless this is a real-time kernel. Expect color "
@@ -377,12 +397,61 @@ public:
     io_->ClearBits(bits_);
     Timers::sleep_nanos(nano_specs_[time_spec_number]);
     io_->SetBits(bits_);
+    // Stay dark for the rest of the unscaled time, otherwise the frames just
+    // get shorter and the brightness doesn't change.
+    const long dark
+      = base_specs_[time_spec_number] - nano_specs_[time_spec_number];
+    if (dark > 0) Timers::sleep_nanos(dark);
+  }
+
+  virtual void SendDarkPulse(int time_spec_number) {
+    Timers::sleep_nanos(base_specs_[time_spec_number]);
+  }
+
+  virtual void SetPulseScale(int percent) {
+    for (size_t i = 0; i < base_specs_.size(); ++i) {
+      nano_specs_[i] = base_specs_[i] * percent / 100;
+    }
   }
 
 private:
   GPIO *const io_;
   const uint32_t bits_;
-  const std::vector<int> nano_specs_;
+  const std::vector<int> base_specs_;
+  std::vector<int> nano_specs_;
+};
+
+// Pulses via the GPIOBackend, that takes care of the timing if needed.
+class BackendPinPulser : public PinPulser {
+public:
+  BackendPinPulser(GPIOBackend *backend, uint32_t bits,
+                   const std::vector<int> &nano_specs)
+    : backend_(backend), bits_(bits),
+      base_specs_(nano_specs), nano_specs_(nano_specs) {}
+
+  virtual void SendPulse(int time_spec_number) {
+    backend_->Pulse(bits_, nano_specs_[time_spec_number]);
+    // Like the other pulsers, keep the unscaled time of the plane.
+    const long dark
+      = base_specs_[time_spec_number] - nano_specs_[time_spec_number];
+    if (dark > 0) backend_->Wait(dark);
+  }
+
+  virtual void SendDarkPulse(int time_spec_number) {
+    backend_->Wait(base_specs_[time_spec_number]);
+  }
+
+  virtual void SetPulseScale(int percent) {
+    for (size_t i = 0; i < base_specs_.size(); ++i) {
+      nano_specs_[i] = base_specs_[i] * percent / 100;
+    }
+  }
+
+private:
+  GPIOBackend *const backend_;
+  const uint32_t bits_;
+  const std::vector<int> base_specs_;
+  std::vector<int> nano_specs_;
 };
 
 static bool LinuxHasModuleLoaded(const char *name) {
@@ -578,7 +647,7 @@ public:
   }
 
   HardwarePinPulser(uint32_t pins, const std::vector<int> &specs)
-    : triggered_(false) {
+    : specs_(specs), dark_time_us_(0), triggered_(false) {
     assert(CanHandle(pins));
     assert(s_CLK_registers && s_PWM_registers && s_Timer1Mhz);
 
@@ -668,6 +737,16 @@ public:
     s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
   }
 
+  // Like a pulse with the PWM left off: WaitPulseFinished() then only waits
+  // for the time to pass, so the next row is clocked in meanwhile as usual.
+  virtual void SendDarkPulse(int c) {
+    WaitPulseFinished();
+    sleep_hint_us_ = sleep_hints_us_[c];
+    dark_time_us_ = (specs_[c] + 999) / 1000;
+    start_time_ = *s_Timer1Mhz;
+    triggered_ = true;
+  }
+
   virtual void WaitPulseFinished() {
     if (!triggered_) return;
     // Determine how long we already spent and sleep to get close to the
@@ -699,10 +778,17 @@ public:
       }
     }
 
-    while ((s_PWM_registers[PWM_STA] & PWM_STA_EMPT1) == 0) {
-      // busy wait until done.
+    if (dark_time_us_ > 0) {
+      while ((int)(*s_Timer1Mhz - start_time_) < dark_time_us_) {
+        // busy wait until done.
+      }
+      dark_time_us_ = 0;
+    } else {
+      while ((s_PWM_registers[PWM_STA] & PWM_STA_EMPT1) == 0) {
+        // busy wait until done.
+      }
+      s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_POLA1 | PWM_CTL_CLRF1;
     }
-    s_PWM_registers[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_POLA1 | PWM_CTL_CLRF1;
     triggered_ = false;
   }
 
@@ -734,11 +820,13 @@ private:
   }
 
 private:
+  const std::vector<int> specs_;
   std::vector<uint32_t> pwm_range_;
   std::vector<int> sleep_hints_us_;
   volatile uint32_t *fifo_;
   uint32_t start_time_;
   int sleep_hint_us_;
+  int dark_time_us_;   // Set while waiting for a SendDarkPulse().
   bool triggered_;
 };
 
@@ -748,6 +836,9 @@ private:
 PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
                              bool allow_hardware_pulsing,
                              const std::vector<int> &nano_wait_spec) {
+  if (io->backend() != NULL) {
+    return new BackendPinPulser(io->backend(), gpio_mask, nano_wait_spec);
+  }
   if (!Timers::Init()) return NULL;
   if (allow_hardware_pulsing && HardwarePinPulser::CanHandle(gpio_mask)) {
     return new HardwarePinPulser(gpio_mask, nano_wait_spec);
@@ -756,6 +847,63 @@ PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
   }
 }
 
+RecordingGPIOBackend::RecordingGPIOBackend(size_t max_events)
+  : max_events_(max_events), pending_dropped_(0), dropped_(0), inputs_(0) {
+}
+
+size_t RecordingGPIOBackend::TakeEvents(std::vector<Event> *events) {
+  MutexLock l(&mutex_);
+  events->clear();
+  events->swap(events_);
+  const size_t dropped = dropped_;
+  dropped_ = 0;
+  return dropped;
+}
+
+void RecordingGPIOBackend::SetInputs(uint32_t inputs) {
+  MutexLock l(&mutex_);
+  inputs_ = inputs;
+}
+
+void RecordingGPIOBackend::Record(Event::Type type, uint32_t bits,
+                                  uint32_t nanoseconds) {
+  if (pending_.size() >= max_events_) {
+    ++pending_dropped_;
+    return;
+  }
+  const Event event = { type, bits, nanoseconds };
+  pending_.push_back(event);
+}
+
+void RecordingGPIOBackend::HandOver() {
+  MutexLock l(&mutex_);
+  const size_t room = max_events_ - std::min(max_events_, events_.size());
+  const size_t count = std::min(room, pending_.size());
+  events_.insert(events_.end(), pending_.begin(), pending_.begin() + count);
+  dropped_ += pending_dropped_ + (pending_.size() - count);
+  pending_.clear();
+  pending_dropped_ = 0;
+}
+
+void RecordingGPIOBackend::SetBits(uint32_t value) {
+  Record(Event::SET, value, 0);
+}
+void RecordingGPIOBackend::ClearBits(uint32_t value) {
+  Record(Event::CLEAR, value, 0);
+}
+uint32_t RecordingGPIOBackend::Read() {
+  MutexLock l(&mutex_);
+  return inputs_;
+}
+void RecordingGPIOBackend::Pulse(uint32_t bits, long nanoseconds) {
+  Record(Event::PULSE, bits, nanoseconds);
+  HandOver();
+}
+void RecordingGPIOBackend::Wait(long nanoseconds) {
+  Record(Event::WAIT, 0, nanoseconds);
+  HandOver();
+}
+
 // For external use, e.g. in the matrix for extra time.
 uint32_t GetMicrosecondCounter() {
   if (s_Timer1Mhz) return *s_Timer1Mhz;
@@ -16,6 +16,7 @@
 // C-bridge for led matrix.
 #include "led-matrix-c.h"
 
+#include <assert.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -74,13 +75,21 @@ struct RGBLedMatrix *led_matrix_create_from_options(
     OPT_COPY_IF_SET(pwm_bits);
     OPT_COPY_IF_SET(pwm_lsb_nanoseconds);
     OPT_COPY_IF_SET(pwm_dither_bits);
+    OPT_COPY_IF_SET(target_refresh);
     OPT_COPY_IF_SET(brightness);
     OPT_COPY_IF_SET(scan_mode);
     OPT_COPY_IF_SET(disable_hardware_pulsing);
     OPT_COPY_IF_SET(show_refresh_rate);
     OPT_COPY_IF_SET(led_rgb_sequence);
     OPT_COPY_IF_SET(pixel_mapper_config);
+    OPT_COPY_IF_SET(gamma);
+    OPT_COPY_IF_SET(white_balance);
     OPT_COPY_IF_SET(inverse_colors);
+    OPT_COPY_IF_SET(limit_pwm_storage);
+    OPT_COPY_IF_SET(packed_bitplanes);
+    OPT_COPY_IF_SET(hardware_brightness);
+    OPT_COPY_IF_SET(skip_blank_planes);
+    OPT_COPY_IF_SET(precompile_scanout);
     OPT_COPY_IF_SET(row_address_type);
 #undef OPT_COPY_IF_SET
   }
@@ -105,13 +114,21 @@ struct RGBLedMatrix *led_matrix_create_from_options(
     ACTUAL_VALUE_BACK_TO_OPT(pwm_bits);
     ACTUAL_VALUE_BACK_TO_OPT(pwm_lsb_nanoseconds);
     ACTUAL_VALUE_BACK_TO_OPT(pwm_dither_bits);
+    ACTUAL_VALUE_BACK_TO_OPT(target_refresh);
     ACTUAL_VALUE_BACK_TO_OPT(brightness);
     ACTUAL_VALUE_BACK_TO_OPT(scan_mode);
     ACTUAL_VALUE_BACK_TO_OPT(disable_hardware_pulsing);
     ACTUAL_VALUE_BACK_TO_OPT(show_refresh_rate);
     ACTUAL_VALUE_BACK_TO_OPT(led_rgb_sequence);
     ACTUAL_VALUE_BACK_TO_OPT(pixel_mapper_config);
+    ACTUAL_VALUE_BACK_TO_OPT(gamma);
+    ACTUAL_VALUE_BACK_TO_OPT(white_balance);
     ACTUAL_VALUE_BACK_TO_OPT(inverse_colors);
+    ACTUAL_VALUE_BACK_TO_OPT(limit_pwm_storage);
+    ACTUAL_VALUE_BACK_TO_OPT(packed_bitplanes);
+    ACTUAL_VALUE_BACK_TO_OPT(hardware_brightness);
+    ACTUAL_VALUE_BACK_TO_OPT(skip_blank_planes);
+    ACTUAL_VALUE_BACK_TO_OPT(precompile_scanout);
     ACTUAL_VALUE_BACK_TO_OPT(row_address_type);
 #undef ACTUAL_VALUE_BACK_TO_OPT
   }
@@ -150,11 +167,37 @@ struct LedCanvas *led_matrix_create_offscreen_canvas(struct RGBLedMatrix *m) {
   return from_canvas(to_matrix(m)->CreateFrameCanvas());
 }
 
+struct LedCanvas *led_matrix_create_scroll_canvas(struct RGBLedMatrix *m,
+                                                  int width) {
+  return from_canvas(to_matrix(m)->CreateScrollCanvas(width));
+}
+
+void led_matrix_pan_on_vsync(struct RGBLedMatrix *matrix, int column) {
+  to_matrix(matrix)->PanOnVSync(column);
+}
+
 struct LedCanvas *led_matrix_swap_on_vsync(struct RGBLedMatrix *matrix,
                                            struct LedCanvas *canvas) {
   return from_canvas(to_matrix(matrix)->SwapOnVSync(to_canvas(canvas)));
 }
 
+struct LedCanvas *led_matrix_submit_frame(struct RGBLedMatrix *matrix,
+                                          struct LedCanvas *canvas) {
+  return from_canvas(to_matrix(matrix)->SubmitFrame(to_canvas(canvas)));
+}
+
+int led_matrix_queue_frame(struct RGBLedMatrix *matrix,
+                           struct LedCanvas *canvas, uint64_t present_at_us) {
+  return to_matrix(matrix)->QueueFrame(to_canvas(canvas), present_at_us);
+}
+
+struct LedCanvas *led_matrix_await_released_frame(struct RGBLedMatrix *matrix,
+                                                  int timeout_ms,
+                                                  uint64_t *presented_at_us) {
+  return from_canvas(to_matrix(matrix)->AwaitReleasedFrame(timeout_ms,
+                                                           presented_at_us));
+}
+
 void led_matrix_set_brightness(struct RGBLedMatrix *matrix,
                                uint8_t brightness) {
   to_matrix(matrix)->SetBrightness(brightness);
@@ -164,6 +207,40 @@ uint8_t led_matrix_get_brightness(struct RGBLedMatrix *matrix) {
   return to_matrix(matrix)->brightness();
 }
 
+void led_matrix_set_gamma(struct RGBLedMatrix *matrix,
+                          float red, float green, float blue) {
+  to_matrix(matrix)->SetGamma(red, green, blue);
+}
+
+void led_matrix_set_white_balance(struct RGBLedMatrix *matrix,
+                                  float red, float green, float blue) {
+  to_matrix(matrix)->SetWhiteBalance(red, green, blue);
+}
+
+int led_matrix_get_refresh_stats(struct RGBLedMatrix *matrix,
+                                 struct LedRefreshStats *stats) {
+  rgb_matrix::RGBMatrix::RefreshStats s;
+  if (!to_matrix(matrix)->GetRefreshStats(&s)) return 0;
+  stats->frames = s.frames;
+  stats->last_frame_us = s.last_frame_us;
+  stats->max_frame_us = s.max_frame_us;
+  stats->total_frame_us = s.total_frame_us;
+  const int buckets = (sizeof(stats->frame_time_histogram)
+                       / sizeof(stats->frame_time_histogram[0]));
+  assert(buckets == rgb_matrix::RGBMatrix::RefreshStats::kHistogramBuckets);
+  for (int i = 0; i < buckets; ++i) {
+    stats->frame_time_histogram[i] = s.frame_time_histogram[i];
+  }
+  stats->swaps = s.swaps;
+  stats->total_swap_wait_us = s.total_swap_wait_us;
+  stats->max_swap_wait_us = s.max_swap_wait_us;
+  stats->missed_swaps = s.missed_swaps;
+  stats->dropped_frames = s.dropped_frames;
+  stats->pwm_bits = s.pwm_bits;
+  stats->pwm_dither_bits = s.pwm_dither_bits;
+  return 1;
+}
+
 void led_canvas_get_size(const struct LedCanvas *canvas,
                          int *width, int *height) {
   rgb_matrix::FrameCanvas *c = to_canvas((struct LedCanvas*)canvas);
@@ -177,6 +254,11 @@ void led_canvas_set_pixel(struct LedCanvas *canvas, int x, int y,
   to_canvas(canvas)->SetPixel(x, y, r, g, b);
 }
 
+void led_canvas_get_pixel(const struct LedCanvas *canvas, int x, int y,
+                          uint8_t *r, uint8_t *g, uint8_t *b) {
+  to_canvas((struct LedCanvas*)canvas)->GetPixel(x, y, r, g, b);
+}
+
 void led_canvas_clear(struct LedCanvas *canvas) {
   to_canvas(canvas)->Clear();
 }
@@ -185,6 +267,16 @@ void led_canvas_fill(struct LedCanvas *canvas, uint8_t r, uint8_t g, uint8_t b)
   to_canvas(canvas)->Fill(r, g, b);
 }
 
+void led_canvas_set_scroll_offset(struct LedCanvas *canvas, int column) {
+  to_canvas(canvas)->SetScrollOffset(column);
+}
+
+void led_canvas_blit(struct LedCanvas *dst, const struct LedCanvas *src,
+                     int sx, int sy, int width, int height, int dx, int dy) {
+  to_canvas(dst)->BlitFrom(*to_canvas((struct LedCanvas*)src),
+                           sx, sy, width, height, dx, dy);
+}
+
 struct LedFont *load_font(const char *bdf_font_file) {
 	rgb_matrix::Font* font = new rgb_matrix::Font();
 	font->LoadFont(bdf_font_file);
@@ -24,6 +24,12 @@
 #include <time.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <vector>
 
 #include "gpio.h"
 #include "thread.h"
@@ -49,70 +55,340 @@
 namespace rgb_matrix {
 using namespace internal;
 
+// Refresh statistics. They are only written by the refresh thread, so there
+// is only ever one writer. Readers don't take any lock: the sequence number is odd while an
+// update is in progress and changes with every update, so readers retry
+// until they got a consistent copy.
+class RefreshStatsCollector {
+public:
+  RefreshStatsCollector() : sequence_(0) {}
+
+  void AddFrame(uint32_t frame_us, bool measure_max) {
+    int bucket = 0;
+    for (uint32_t t = frame_us >> 7;
+         t && bucket < RGBMatrix::RefreshStats::kHistogramBuckets - 1; t >>= 1) {
+      ++bucket;
+    }
+    BeginUpdate();
+    ++stats_.frames;
+    stats_.last_frame_us = frame_us;
+    if (measure_max && frame_us > stats_.max_frame_us)
+      stats_.max_frame_us = frame_us;
+    stats_.total_frame_us += frame_us;
+    ++stats_.frame_time_histogram[bucket];
+    EndUpdate();
+  }
+
+  void AddSwap(uint32_t wait_us) {
+    BeginUpdate();
+    ++stats_.swaps;
+    stats_.total_swap_wait_us += wait_us;
+    if (wait_us > stats_.max_swap_wait_us) stats_.max_swap_wait_us = wait_us;
+    EndUpdate();
+  }
+
+  void AddMissedSwaps(unsigned count) {
+    BeginUpdate();
+    stats_.missed_swaps += count;
+    EndUpdate();
+  }
+
+  void SetShownBits(int pwm_bits, int dither_bits) {
+    BeginUpdate();
+    stats_.pwm_bits = pwm_bits;
+    stats_.pwm_dither_bits = dither_bits;
+    EndUpdate();
+  }
+
+  void Get(RGBMatrix::RefreshStats *stats) const {
+    for (;;) {
+      const uint32_t before = sequence_.load(std::memory_order_acquire);
+      if (before & 1) continue;
+      *stats = stats_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == before)
+        return;
+    }
+  }
+
+private:
+  void BeginUpdate() {
+    sequence_.store(sequence_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void EndUpdate() {
+    sequence_.store(sequence_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+  }
+
+  std::atomic<uint32_t> sequence_;
+  RGBMatrix::RefreshStats stats_;
+};
+
+// Prints the refresh rate if Options::show_refresh_rate is set. Runs in its
+// own thread with normal priority, so that terminal output never delays the
+// refresh.
+class RefreshRatePrinter : public Thread {
+public:
+  explicit RefreshRatePrinter(const RefreshStatsCollector *stats)
+    : stats_(stats), running_(true) {}
+  virtual ~RefreshRatePrinter() {
+    Stop();
+    WaitStopped();  // Before our members go away.
+  }
+
+  void Stop() {
+    running_.store(false, std::memory_order_relaxed);
+  }
+
+  virtual void Run() {
+    RGBMatrix::RefreshStats last, now;
+    stats_->Get(&last);
+    while (running_.load(std::memory_order_relaxed)) {
+      usleep(100 * 1000);
+      stats_->Get(&now);
+      if (now.frames == last.frames) continue;
+      const double frame_us = (double)(now.total_frame_us - last.total_frame_us)
+        / (now.frames - last.frames);
+      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / frame_us);
+      if (now.max_frame_us > last.max_frame_us) {
+        printf(" max: %uusec\b\b\b\b\b\b\b\b\b\b\b\b\b\b", now.max_frame_us);
+      }
+      fflush(stdout);
+      last = now;
+    }
+  }
+
+private:
+  const RefreshStatsCollector *const stats_;
+  std::atomic<bool> running_;
+};
+
+// Chooses the pwm bits and dither bits to show for Options::target_refresh.
+//
+// The settings are ordered by quality: most bits first, for the same bits
+// the least dithering. The average frame time of each setting is measured
+// over a couple of frames. If it is too slow for the target, we go one step
+// down. To go up again, we use the difference in frame time measured
+// between the two settings when going down, so we only go up if that
+// still fits with some headroom and don't flip back and forth.
+class RefreshTuner {
+public:
+  RefreshTuner(int target_hz, int max_bits)
+    : target_frame_us_(1e6 / target_hz),
+      window_frames_(std::max(8, (target_hz / 4) & ~3)),
+      level_(0), last_measured_level_(0), frames_(0), sum_us_(0) {
+    for (int bits = max_bits; bits >= 1; --bits) {
+      for (int dither = 0; dither <= 2 && dither < bits; ++dither) {
+        const Setting s = { bits, dither, 0, 0 };
+        settings_.push_back(s);
+      }
+    }
+  }
+
+  int pwm_bits() const { return settings_[level_].bits; }
+  int dither_bits() const { return settings_[level_].dither; }
+
+  // Add the time of a frame shown with the current setting. Returns true
+  // if the setting changed.
+  bool AddFrame(uint32_t frame_us) {
+    if (frames_++ == 0) return false;  // First frame can still be the old one.
+    sum_us_ += frame_us;
+    if (frames_ <= window_frames_) return false;
+
+    const double average_us = sum_us_ / window_frames_;
+    const int previous_level = last_measured_level_;
+    last_measured_level_ = level_;
+    frames_ = 0;
+    sum_us_ = 0;
+    Setting &current = settings_[level_];
+    if (previous_level == level_ - 1) {
+      // Just came down: we now know what the step costs.
+      current.step_up_us = settings_[level_ - 1].measured_us - average_us;
+    } else if (previous_level == level_ + 1) {
+      settings_[level_ + 1].step_up_us
+        = settings_[level_ + 1].measured_us - average_us;
+    }
+    current.measured_us = average_us;
+
+    if (average_us > target_frame_us_) {
+      if (level_ + 1 < (int)settings_.size()) {
+        ++level_;
+        return true;
+      }
+    } else if (level_ > 0 && current.step_up_us > 0
+               && average_us + current.step_up_us < 0.95 * target_frame_us_) {
+      --level_;
+      return true;
+    }
+    return false;
+  }
+
+private:
+  struct Setting {
+    int bits;
+    int dither;
+    double measured_us;   // Average frame time when last shown.
+    double step_up_us;    // Additional time the next better setting needs.
+  };
+
+  const double target_frame_us_;
+  const int window_frames_;    // Multiple of 4, the dither sequence length.
+  std::vector<Setting> settings_;
+  int level_;
+  int last_measured_level_;
+  int frames_;
+  double sum_us_;
+};
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame,
-               int pwm_dither_bits, bool show_refresh)
-    : io_(io), show_refresh_(show_refresh), running_(true),
-      current_frame_(initial_frame), next_frame_(NULL),
-      requested_frame_multiple_(1) {
+               int pwm_bits, int pwm_dither_bits, int target_refresh,
+               bool show_refresh, int pulse_scale)
+    : io_(io), target_refresh_(target_refresh),
+      pwm_dither_bits_(pwm_dither_bits), pwm_bits_(0), tuner_(NULL),
+      running_(true), current_frame_(initial_frame),
+      submitted_frame_(0), dropped_frames_(0), has_request_(false),
+      next_frame_(NULL), swap_result_(NULL),
+      requested_frame_multiple_(1), requested_pulse_scale_(pulse_scale),
+      requested_pwm_bits_(pwm_bits),
+      swap_pending_(false), swap_start_us_(0),
+      pan_pending_(false), requested_viewport_(0),
+      current_from_queue_(false), current_presented_us_(0),
+      swapped_(false), vsyncs_since_swap_(0),
+      refresh_printer_(NULL), timing_enabled_(false), timing_changed_(false),
+      timing_request_(NULL), timing_(NULL) {
     pthread_cond_init(&frame_done_, NULL);
+    pthread_cond_init(&frame_released_, NULL);
+    pthread_cond_init(&timing_done_, NULL);
     pthread_cond_init(&input_change_, NULL);
-    switch (pwm_dither_bits) {
-    case 0:
-      start_bit_[0] = 0; start_bit_[1] = 0;
-      start_bit_[2] = 0; start_bit_[3] = 0;
-      break;
-    case 1:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 0; start_bit_[3] = 1;
-      break;
-    case 2:
-      start_bit_[0] = 0; start_bit_[1] = 1;
-      start_bit_[2] = 2; start_bit_[3] = 2;
-      break;
+    SetMaxPWMBits(pwm_bits);
+    if (show_refresh) {
+      refresh_printer_ = new RefreshRatePrinter(&stats_);
+      refresh_printer_->Start();
     }
   }
 
+  virtual ~UpdateThread() {
+    delete tuner_;
+    delete refresh_printer_;
+    delete timing_;
+  }
+
   void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
+    running_.store(false, std::memory_order_relaxed);
   }
 
   virtual void Run() {
     unsigned frame_count = 0;
+    unsigned frame_multiple = 1;
     unsigned low_bit_sequence = 0;
-    uint32_t largest_time = 0;
     uint32_t last_gpio_bits = 0;
 
     // Let's start measure max time only after a we were running for a few
     // seconds to not pick up start-up glitches.
-    static const int kHoldffTimeUs = 2000 * 1000;
-    uint32_t initial_holdoff_start = GetMicrosecondCounter();
-    bool max_measure_enabled = false;
+    static const uint32_t kHoldffTimeUs = 2000 * 1000;
+    const uint32_t initial_holdoff_start = GetMicrosecondCounter();
+    uint32_t last_frame_end_us = 0;
+    bool first_frame = true;
+
+    int pulse_scale = 100;
+    int next_pulse_scale;
+    {
+      MutexLock l(&frame_sync_);
+      next_pulse_scale = requested_pulse_scale_;
+    }
+
+    while (running_.load(std::memory_order_relaxed)) {
+      // Changing the output-enable timing needs to happen between frames.
+      if (next_pulse_scale != pulse_scale) {
+        pulse_scale = next_pulse_scale;
+        Framebuffer::SetPulseScale(pulse_scale);
+      }
 
-    while (running()) {
       const uint32_t start_time_us = GetMicrosecondCounter();
 
       current_frame_->framebuffer()
-        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4]);
+        ->DumpToMatrix(io_, start_bit_[low_bit_sequence % 4], timing_);
+
+      // Frames are measured from one exchange to the next, so they include
+      // everything done per frame.
+      const uint32_t now_us = GetMicrosecondCounter();
+      stats_.AddFrame(now_us - (first_frame ? start_time_us
+                                            : last_frame_end_us),
+                      now_us - initial_holdoff_start > kHoldffTimeUs);
+      if (tuner_ && !first_frame
+          && tuner_->AddFrame(now_us - last_frame_end_us)) {
+        SetShownBits(tuner_->pwm_bits(), tuner_->dither_bits());
+      }
+      last_frame_end_us = now_us;
+      first_frame = false;
+
+      // SubmitFrame() exchange: show the newest submitted frame and make
+      // the one we showed so far available to the submitter.
+      if (submitted_frame_.load(std::memory_order_relaxed) & kNewFrame) {
+        const uintptr_t submitted = submitted_frame_.exchange(
+          reinterpret_cast<uintptr_t>(current_frame_),
+          std::memory_order_acq_rel);
+        current_frame_ = reinterpret_cast<FrameCanvas*>(submitted & ~kNewFrame);
+      }
 
-      // SwapOnVSync() exchange.
-      {
+      // SwapOnVSync() and other requests only take the lock if there is
+      // something to do.
+      bool vsync;
+      if (has_request_.load(std::memory_order_acquire)) {
         MutexLock l(&frame_sync_);
-        // Do fast equality test first (likely due to frame_count reset).
-        if (frame_count == requested_frame_multiple_
-            || frame_count % requested_frame_multiple_ == 0) {
-          // We reset to avoid frame hick-up every couple of weeks
-          // run-time iff requested_frame_multiple_ is not a factor of 2^32.
-          frame_count = 0;
+        if (timing_changed_) {
+          delete timing_;
+          timing_ = timing_enabled_ ? new RefreshTiming() : NULL;
+          timing_changed_ = false;
+        }
+        if (timing_request_ != NULL) {
+          *timing_request_ = *timing_;
+          timing_request_ = NULL;
+          pthread_cond_broadcast(&timing_done_);
+        }
+
+        if (!presentation_queue_.empty()) {
+          PresentDueFrames();
+        }
+
+        frame_multiple = requested_frame_multiple_;
+        vsync = IsVSync(&frame_count, frame_multiple);
+        if (vsync && swap_pending_) {
+          swap_result_ = current_frame_;
           if (next_frame_ != NULL) {
             current_frame_ = next_frame_;
             next_frame_ = NULL;
           }
+          if (pan_pending_) {
+            current_frame_->SetScrollOffset(requested_viewport_);
+            pan_pending_ = false;
+          }
+          // Every vsync since the previous swap without a new swap waiting
+          // was missed.
+          if (swapped_ && vsyncs_since_swap_ > 0)
+            stats_.AddMissedSwaps(vsyncs_since_swap_);
+          stats_.AddSwap(GetMicrosecondCounter() - swap_start_us_);
+          swap_pending_ = false;
+          swapped_ = true;
+          vsyncs_since_swap_ = 0;
           pthread_cond_signal(&frame_done_);
+        } else if (vsync) {
+          ++vsyncs_since_swap_;
+        }
+        next_pulse_scale = requested_pulse_scale_;
+        if (requested_pwm_bits_ != pwm_bits_) {
+          SetMaxPWMBits(requested_pwm_bits_);
         }
+        has_request_.store(swap_pending_ || !presentation_queue_.empty(),
+                           std::memory_order_relaxed);
+      } else {
+        vsync = IsVSync(&frame_count, frame_multiple);
+        if (vsync) ++vsyncs_since_swap_;
       }
 
       // Read input bits.
@@ -132,27 +408,103 @@ public:
         // busy wait.
       }
 #endif
-      const uint32_t end_time_us = GetMicrosecondCounter();
-      if (show_refresh_) {
-        uint32_t usec = end_time_us - start_time_us;
-        printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-        if (usec > largest_time && max_measure_enabled) {
-          largest_time = usec;
-          printf(" max: %uusec\b\b\b\b\b\b\b\b\b\b\b\b\b\b", largest_time);
-        } else {
-          max_measure_enabled = (end_time_us - initial_holdoff_start) > kHoldffTimeUs;
-        }
-      }
     }
   }
 
   FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned frame_fraction) {
+    return ExchangeOnVSync(other, frame_fraction, false, 0);
+  }
+
+  // Move the viewport of the frame shown at the next vsync to "column".
+  void PanOnVSync(int column, unsigned frame_fraction) {
+    ExchangeOnVSync(NULL, frame_fraction, true, column);
+  }
+
+  FrameCanvas *ExchangeOnVSync(FrameCanvas *other, unsigned frame_fraction,
+                               bool pan, int column) {
+    const uint32_t start_us = GetMicrosecondCounter();
     MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
     next_frame_ = other;
+    pan_pending_ = pan;
+    requested_viewport_ = column;
     requested_frame_multiple_ = frame_fraction;
-    frame_sync_.WaitOn(&frame_done_);
-    return previous;
+    swap_pending_ = true;
+    swap_start_us_ = start_us;
+    has_request_.store(true, std::memory_order_release);
+    while (swap_pending_) {
+      frame_sync_.WaitOn(&frame_done_);
+    }
+    return swap_result_;
+  }
+
+  // Returns the frame the refresh thread gave back in the last exchange,
+  // NULL at the very first call.
+  FrameCanvas *SubmitFrame(FrameCanvas *frame) {
+    const uintptr_t previous = submitted_frame_.exchange(
+      reinterpret_cast<uintptr_t>(frame) | kNewFrame,
+      std::memory_order_acq_rel);
+    if (previous & kNewFrame)
+      dropped_frames_.fetch_add(1, std::memory_order_relaxed);
+    return reinterpret_cast<FrameCanvas*>(previous & ~kNewFrame);
+  }
+
+  void QueueFrame(FrameCanvas *frame, uint64_t present_at_us) {
+    MutexLock l(&frame_sync_);
+    const TimedFrame queued = { frame, present_at_us };
+    presentation_queue_.push_back(queued);
+    has_request_.store(true, std::memory_order_release);
+  }
+
+  FrameCanvas *AwaitReleasedFrame(int timeout_ms, uint64_t *presented_at_us) {
+    MutexLock l(&frame_sync_);
+    while (released_frames_.empty()) {
+      if (!frame_sync_.WaitOn(&frame_released_, timeout_ms))
+        return NULL;
+    }
+    const TimedFrame released = released_frames_.front();
+    released_frames_.pop_front();
+    if (presented_at_us) *presented_at_us = released.time_us;
+    return released.frame;
+  }
+
+  void GetRefreshStats(RefreshStats *stats) const {
+    stats_.Get(stats);
+    stats->dropped_frames = dropped_frames_.load(std::memory_order_relaxed);
+  }
+
+  // Timing is only touched by the refresh thread while sending a frame, so
+  // changes and read-out are handed to it and done between frames.
+  void EnableRefreshTiming(bool enable) {
+    MutexLock l(&frame_sync_);
+    timing_enabled_ = enable;
+    timing_changed_ = true;
+    has_request_.store(true, std::memory_order_release);
+  }
+
+  bool GetRefreshTiming(RefreshTiming *timing) {
+    MutexLock l(&frame_sync_);
+    if (!timing_enabled_) return false;
+    timing_request_ = timing;
+    has_request_.store(true, std::memory_order_release);
+    while (timing_request_ != NULL) {
+      frame_sync_.WaitOn(&timing_done_);
+    }
+    return true;
+  }
+
+  // Takes effect with the next refresh. With a target refresh rate, the
+  // tuning starts over from the new pwm bits.
+  void SetPWMBits(int pwm_bits) {
+    MutexLock l(&frame_sync_);
+    requested_pwm_bits_ = pwm_bits;
+    has_request_.store(true, std::memory_order_release);
+  }
+
+  // Takes effect with the next refresh.
+  void SetPulseScale(int percent) {
+    MutexLock l(&frame_sync_);
+    requested_pulse_scale_ = percent;
+    has_request_.store(true, std::memory_order_release);
   }
 
   uint32_t AwaitInputChange(int timeout_ms) {
@@ -162,29 +514,160 @@ public:
   }
 
 private:
-  inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+  // Low bit of submitted_frame_: set while the frame wasn't picked up yet.
+  static const uintptr_t kNewFrame = 1;
+
+  static bool IsVSync(unsigned *frame_count, unsigned frame_multiple) {
+    // Do fast equality test first (likely due to frame_count reset).
+    if (*frame_count == frame_multiple || *frame_count % frame_multiple == 0) {
+      // We reset to avoid frame hick-up every couple of weeks
+      // run-time iff frame_multiple is not a factor of 2^32.
+      *frame_count = 0;
+      return true;
+    }
+    return false;
+  }
+
+  static uint64_t MonotonicMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // Show the last queued frame that is due, release what it replaces.
+  // Called with frame_sync_ held, between frames.
+  void PresentDueFrames() {
+    const uint64_t now_us = MonotonicMicros();
+    FrameCanvas *show = NULL;
+    while (!presentation_queue_.empty()
+           && presentation_queue_.front().time_us <= now_us) {
+      if (show) ReleaseFrame(show, 0);  // Skipped, a later one is due.
+      show = presentation_queue_.front().frame;
+      presentation_queue_.pop_front();
+    }
+    if (show == NULL) return;
+    if (current_from_queue_) ReleaseFrame(current_frame_, current_presented_us_);
+    current_frame_ = show;
+    current_from_queue_ = true;
+    current_presented_us_ = now_us;
+  }
+
+  void ReleaseFrame(FrameCanvas *frame, uint64_t presented_us) {
+    const TimedFrame released = { frame, presented_us };
+    released_frames_.push_back(released);
+    pthread_cond_signal(&frame_released_);
+  }
+
+  // Set the pwm bits the frames are configured with; the tuner goes down
+  // from there.
+  void SetMaxPWMBits(int pwm_bits) {
+    pwm_bits_ = pwm_bits;
+    if (target_refresh_ > 0) {
+      delete tuner_;
+      tuner_ = new RefreshTuner(target_refresh_, pwm_bits);
+      SetShownBits(tuner_->pwm_bits(), tuner_->dither_bits());
+    } else {
+      // Frames limit themselves to their own pwm bits.
+      SetShownBits(RefreshTiming::kBitPlanes, pwm_dither_bits_);
+      stats_.SetShownBits(pwm_bits, pwm_dither_bits_);
+    }
+  }
+
+  // Show the upper pwm_bits bit planes, the lowest of them dithered.
+  void SetShownBits(int pwm_bits, int dither_bits) {
+    static const uint32_t kDitherOffset[3][4] = {
+      { 0, 0, 0, 0 },
+      { 0, 1, 0, 1 },
+      { 0, 1, 2, 2 },
+    };
+    const uint32_t low_bit = RefreshTiming::kBitPlanes - pwm_bits;
+    for (int i = 0; i < 4; ++i) {
+      start_bit_[i] = low_bit + kDitherOffset[dither_bits][i];
+    }
+    if (tuner_) stats_.SetShownBits(pwm_bits, dither_bits);
   }
 
   GPIO *const io_;
-  const bool show_refresh_;
+  const int target_refresh_;
+  const int pwm_dither_bits_;
+  int pwm_bits_;                // Only accessed by the refresh thread.
   uint32_t start_bit_[4];
+  RefreshTuner *tuner_;         // Only with a target refresh rate.
 
-  Mutex running_mutex_;
-  bool running_;
+  std::atomic<bool> running_;
 
   Mutex input_sync_;
   pthread_cond_t input_change_;
   uint32_t gpio_inputs_;
 
+  FrameCanvas *current_frame_;  // Only accessed by the refresh thread.
+
+  // Triple-buffering: the frame handed over in SubmitFrame() (with kNewFrame)
+  // or, after the refresh thread picked it up, the one shown before.
+  std::atomic<uintptr_t> submitted_frame_;
+  std::atomic<uint64_t> dropped_frames_;
+
+  // Set if anything below needs the refresh thread's attention.
+  std::atomic<bool> has_request_;
+
   Mutex frame_sync_;
   pthread_cond_t frame_done_;
-  FrameCanvas *current_frame_;
   FrameCanvas *next_frame_;
+  FrameCanvas *swap_result_;
   unsigned requested_frame_multiple_;
+  int requested_pulse_scale_;
+  int requested_pwm_bits_;
+  bool swap_pending_;           // A caller waits in SwapOnVSync()
+  uint32_t swap_start_us_;
+  bool pan_pending_;            // ... or in PanOnVSync().
+  int requested_viewport_;
+
+  struct TimedFrame {
+    FrameCanvas *frame;
+    // Queued: requested presentation time. Released: actual, 0 if skipped.
+    uint64_t time_us;
+  };
+  std::deque<TimedFrame> presentation_queue_;
+  std::deque<TimedFrame> released_frames_;
+  pthread_cond_t frame_released_;
+  bool current_from_queue_;     // current_frame_ came from QueueFrame().
+  uint64_t current_presented_us_;
+
+  bool swapped_;
+  unsigned vsyncs_since_swap_;  // Only accessed by the refresh thread.
+
+  RefreshStatsCollector stats_;
+  RefreshRatePrinter *refresh_printer_;
+
+  bool timing_enabled_;
+  bool timing_changed_;
+  RefreshTiming *timing_request_;
+  pthread_cond_t timing_done_;
+  RefreshTiming *timing_;     // Only accessed by the refresh thread.
 };
 
+RefreshTiming::RefreshTiming() : frames(0), double_rows(0) {
+  memset(nanoseconds, 0, sizeof(nanoseconds));
+  memset(samples, 0, sizeof(samples));
+}
+
+uint64_t RefreshTiming::PhaseTotal(Phase phase) const {
+  uint64_t total = 0;
+  for (int row = 0; row < double_rows; ++row) {
+    for (int b = 0; b < kBitPlanes; ++b) {
+      total += nanoseconds[row][b][phase];
+    }
+  }
+  return total;
+}
+
+RGBMatrix::RefreshStats::RefreshStats()
+  : frames(0), last_frame_us(0), max_frame_us(0), total_frame_us(0),
+    swaps(0), total_swap_wait_us(0), max_swap_wait_us(0), missed_swaps(0),
+    pwm_bits(0), pwm_dither_bits(0) {
+  for (int i = 0; i < kHistogramBuckets; ++i) frame_time_histogram[i] = 0;
+}
+
 // Some defaults. See options-initialize.cc for the command line parsing.
 RGBMatrix::Options::Options() :
   // Historically, we provided these options only as #defines. Make sure that
@@ -205,7 +688,10 @@ RGBMatrix::Options::Options() :
 #endif
 
   pwm_dither_bits(0),
+  target_refresh(0),
   brightness(100),
+  gamma("0"),
+  white_balance("1"),
 
 #ifdef RGB_SCAN_INTERLACED
     scan_mode(1),
@@ -233,6 +719,11 @@ RGBMatrix::Options::Options() :
 #else
     inverse_colors(false),
 #endif
+  limit_pwm_storage(false),
+  packed_bitplanes(false),
+  hardware_brightness(false),
+  skip_blank_planes(false),
+  precompile_scanout(false),
   led_rgb_sequence("RGB"),
   pixel_mapper_config(NULL)
 {
@@ -240,7 +731,8 @@ RGBMatrix::Options::Options() :
 }
 
 RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
-  : params_(options), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(options), io_(NULL), updater_(NULL), refresh_timing_(false),
+    shared_pixel_mapper_(NULL) {
   assert(params_.Validate(NULL));
   const MultiplexMapper *multiplex_mapper = NULL;
   if (params_.multiplexing > 0) {
@@ -257,6 +749,9 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
     multiplex_mapper->EditColsRows(&params_.cols, &params_.rows);
   }
 
+  pwm_storage_bits_ = params_.limit_pwm_storage ? params_.pwm_bits : 11;
+  ParseColorCorrection(params_.gamma, 0, 5, gamma_);
+  ParseColorCorrection(params_.white_balance, 0, 1, white_balance_);
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
   active_ = CreateFrameCanvas();
   Clear();
@@ -272,11 +767,15 @@ RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
 
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
-  : params_(Options()), io_(NULL), updater_(NULL), shared_pixel_mapper_(NULL) {
+  : params_(Options()), io_(NULL), updater_(NULL), refresh_timing_(false),
+    shared_pixel_mapper_(NULL) {
   params_.rows = rows;
   params_.chain_length = chained_displays;
   params_.parallel = parallel_displays;
   assert(params_.Validate(NULL));
+  pwm_storage_bits_ = 11;
+  ParseColorCorrection(params_.gamma, 0, 5, gamma_);
+  ParseColorCorrection(params_.white_balance, 0, 1, white_balance_);
   Framebuffer::InitHardwareMapping(params_.hardware_mapping);
   active_ = CreateFrameCanvas();
   Clear();
@@ -328,10 +827,14 @@ void RGBMatrix::ApplyNamedPixelMappers(const char *pixel_mapper_config,
 void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
   if (io != NULL && io_ == NULL) {
     io_ = io;
+    // The hardware pulser doesn't implement SetPulseScale(), so hardware
+    // brightness needs the timer based one.
     Framebuffer::InitGPIO(io_, params_.rows, params_.parallel,
-                          !params_.disable_hardware_pulsing,
+                          !params_.disable_hardware_pulsing
+                          && !params_.hardware_brightness,
                           params_.pwm_lsb_nanoseconds, params_.pwm_dither_bits,
-                          params_.row_address_type);
+                          params_.row_address_type,
+                          params_.skip_blank_planes);
   }
   if (start_thread) {
     StartRefresh();
@@ -340,8 +843,13 @@ void RGBMatrix::SetGPIO(GPIO *io, bool start_thread) {
 
 bool RGBMatrix::StartRefresh() {
   if (updater_ == NULL && io_ != NULL) {
-    updater_ = new UpdateThread(io_, active_, params_.pwm_dither_bits,
-                                params_.show_refresh_rate);
+    updater_ = new UpdateThread(io_, active_, params_.pwm_bits,
+                                params_.pwm_dither_bits,
+                                params_.target_refresh,
+                                params_.show_refresh_rate,
+                                params_.hardware_brightness
+                                ? params_.brightness : 100);
+    if (refresh_timing_) updater_->EnableRefreshTiming(true);
     // If we have multiple processors, the kernel
     // jumps around between these, creating some global flicker.
     // So let's tie it to the last CPU available.
@@ -355,14 +863,28 @@ bool RGBMatrix::StartRefresh() {
 }
 
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
+  return CreateCanvas(params_.cols * params_.chain_length, false);
+}
+
+FrameCanvas *RGBMatrix::CreateScrollCanvas(int width) {
+  if (width < params_.cols * params_.chain_length) return NULL;
+  if (params_.multiplexing > 0) return NULL;
+  return CreateCanvas(width, true);
+}
+
+FrameCanvas *RGBMatrix::CreateCanvas(int columns, bool own_mapper) {
+  MutexLock l(&created_frames_lock_);
   FrameCanvas *result =
     new FrameCanvas(new Framebuffer(params_.rows,
-                                    params_.cols * params_.chain_length,
+                                    columns,
                                     params_.parallel,
                                     params_.scan_mode,
                                     params_.led_rgb_sequence,
                                     params_.inverse_colors,
-                                    &shared_pixel_mapper_));
+                                    pwm_storage_bits_,
+                                    params_.packed_bitplanes,
+                                    own_mapper ? NULL : &shared_pixel_mapper_,
+                                    params_.cols * params_.chain_length));
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
@@ -370,20 +892,76 @@ FrameCanvas *RGBMatrix::CreateFrameCanvas() {
 
   result->framebuffer()->SetPWMBits(params_.pwm_bits);
   result->framebuffer()->set_luminance_correct(do_luminance_correct_);
-  result->framebuffer()->SetBrightness(params_.brightness);
+  result->framebuffer()->SetBrightness(params_.hardware_brightness
+                                       ? 100 : params_.brightness);
+  result->framebuffer()->SetColorCorrection(gamma_, white_balance_);
 
   created_frames_.push_back(result);
   return result;
 }
 
+void RGBMatrix::PrepareFrame(FrameCanvas *frame) {
+  if (frame && params_.precompile_scanout)
+    frame->framebuffer()->CompileScanStream();
+}
+
+void RGBMatrix::PanOnVSync(int column, unsigned framerate_fraction) {
+  if (!updater_) {
+    active_->SetScrollOffset(column);
+    return;
+  }
+  if (framerate_fraction == 0) framerate_fraction = 1;
+  updater_->PanOnVSync(column, framerate_fraction);
+}
+
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other,
                                     unsigned frame_fraction) {
   if (frame_fraction == 0) frame_fraction = 1; // correct user error.
+  PrepareFrame(other);
   FrameCanvas *const previous = updater_->SwapOnVSync(other, frame_fraction);
   if (other) active_ = other;
   return previous;
 }
 
+bool RGBMatrix::QueueFrame(FrameCanvas *frame, uint64_t present_at_us) {
+  if (!updater_) return false;
+  PrepareFrame(frame);
+  updater_->QueueFrame(frame, present_at_us);
+  return true;
+}
+
+FrameCanvas *RGBMatrix::AwaitReleasedFrame(int timeout_ms,
+                                           uint64_t *presented_at_us) {
+  if (!updater_) return NULL;
+  return updater_->AwaitReleasedFrame(timeout_ms, presented_at_us);
+}
+
+FrameCanvas *RGBMatrix::SubmitFrame(FrameCanvas *other) {
+  // Unlike with SwapOnVSync(), there always needs to be a frame to show.
+  if (other == NULL || updater_ == NULL) return NULL;
+  PrepareFrame(other);
+  FrameCanvas *free_frame = updater_->SubmitFrame(other);
+  active_ = other;
+  // The third buffer is only needed once the first frame is submitted.
+  if (free_frame == NULL) free_frame = CreateFrameCanvas();
+  return free_frame;
+}
+
+bool RGBMatrix::GetRefreshStats(RefreshStats *stats) const {
+  if (!updater_) return false;
+  updater_->GetRefreshStats(stats);
+  return true;
+}
+
+void RGBMatrix::EnableRefreshTiming(bool enable) {
+  refresh_timing_ = enable;
+  if (updater_) updater_->EnableRefreshTiming(enable);
+}
+
+bool RGBMatrix::GetRefreshTiming(RefreshTiming *timing) const {
+  return updater_ && updater_->GetRefreshTiming(timing);
+}
+
 uint32_t RGBMatrix::AwaitInputChange(int timeout_ms) {
   if (!updater_) return 0;
   return updater_->AwaitInputChange(timeout_ms);
@@ -393,6 +971,7 @@ bool RGBMatrix::SetPWMBits(uint8_t value) {
   const bool success = active_->framebuffer()->SetPWMBits(value);
   if (success) {
     params_.pwm_bits = value;
+    if (updater_) updater_->SetPWMBits(value);
   }
   return success;
 }
@@ -408,6 +987,14 @@ bool RGBMatrix::luminance_correct() const {
 }
 
 void RGBMatrix::SetBrightness(uint8_t brightness) {
+  MutexLock l(&created_frames_lock_);
+  if (params_.hardware_brightness) {
+    // Only the output timing changes, the frame-buffers stay at full range.
+    brightness = (brightness <= 100 ? (brightness != 0 ? brightness : 1) : 100);
+    if (updater_) updater_->SetPulseScale(brightness);
+    params_.brightness = brightness;
+    return;
+  }
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     created_frames_[i]->framebuffer()->SetBrightness(brightness);
   }
@@ -418,6 +1005,24 @@ uint8_t RGBMatrix::brightness() {
   return params_.brightness;
 }
 
+void RGBMatrix::SetGamma(float red, float green, float blue) {
+  MutexLock l(&created_frames_lock_);
+  gamma_[0] = red; gamma_[1] = green; gamma_[2] = blue;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->SetColorCorrection(gamma_,
+                                                          white_balance_);
+  }
+}
+
+void RGBMatrix::SetWhiteBalance(float red, float green, float blue) {
+  MutexLock l(&created_frames_lock_);
+  white_balance_[0] = red; white_balance_[1] = green; white_balance_[2] = blue;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->framebuffer()->SetColorCorrection(gamma_,
+                                                          white_balance_);
+  }
+}
+
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
 int RGBMatrix::width() const {
   return active_->width();
@@ -449,7 +1054,7 @@ bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
     return false;
   }
   PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
+    new_width, new_height, *shared_pixel_mapper_);
   for (int y = 0; y < new_height; ++y) {
     for (int x = 0; x < new_width; ++x) {
       int orig_x = -1, orig_y = -1;
@@ -466,6 +1071,7 @@ bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper) {
       *new_mapper->get(x, y) = *orig_designator;
     }
   }
+  new_mapper->ComputeRuns();
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
   return true;
@@ -531,7 +1137,7 @@ void RGBMatrix::ApplyStaticTransformerDeprecated(
   const int new_width = mapped_canvas->width();
   const int new_height = mapped_canvas->height();
   PixelDesignatorMap *new_mapper = new PixelDesignatorMap(
-    new_width, new_height, shared_pixel_mapper_->GetFillColorBits());
+    new_width, new_height, *shared_pixel_mapper_);
   extractor_canvas.SetNewMapper(new_mapper);
   // Learn about the pixel mapping by going through all transformed pixels and
   // build new PixelDesignator map.
@@ -541,6 +1147,7 @@ void RGBMatrix::ApplyStaticTransformerDeprecated(
       mapped_canvas->SetPixel(x, y, 0, 0, 0); // force copy of designator.
     }
   }
+  new_mapper->ComputeRuns();
   delete shared_pixel_mapper_;
   shared_pixel_mapper_ = new_mapper;
 }
@@ -568,6 +1175,15 @@ bool FrameCanvas::luminance_correct() const { return frame_->luminance_correct()
 void FrameCanvas::SetBrightness(uint8_t brightness) { frame_->SetBrightness(brightness); }
 uint8_t FrameCanvas::brightness() { return frame_->brightness(); }
 
+void FrameCanvas::SetGamma(float red, float green, float blue) {
+  const float gamma[3] = { red, green, blue };
+  frame_->SetColorCorrection(gamma, frame_->white_point());
+}
+void FrameCanvas::SetWhiteBalance(float red, float green, float blue) {
+  const float white_point[3] = { red, green, blue };
+  frame_->SetColorCorrection(frame_->gamma(), white_point);
+}
+
 void FrameCanvas::Serialize(const char **data, size_t *len) const {
   frame_->Serialize(data, len);
 }
@@ -577,4 +1193,38 @@ bool FrameCanvas::Deserialize(const char *data, size_t len) {
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
+void FrameCanvas::SetScrollOffset(int column) {
+  frame_->SetScrollOffset(column);
+}
+int FrameCanvas::scroll_offset() const { return frame_->scroll_offset(); }
+uint64_t FrameCanvas::dirty_rows() const { return frame_->dirty_rows(); }
+void FrameCanvas::ClearDirtyRows() { frame_->ClearDirtyRows(); }
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *rgb, int stride) {
+  if (stride == 0) stride = 3 * width;
+  frame_->SetPixels(x, y, width, height, rgb, stride);
+}
+void FrameCanvas::SetImage(const uint8_t *rgb, int stride) {
+  SetPixels(0, 0, width(), height(), rgb, stride);
+}
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::BlitFrom(const FrameCanvas &src, int sx, int sy,
+                           int width, int height, int dx, int dy) {
+  frame_->BlitFrom(*src.frame_, sx, sy, width, height, dx, dy);
+}
+void FrameCanvas::GetPixel(int x, int y,
+                           uint8_t *red, uint8_t *green, uint8_t *blue) const {
+  frame_->GetPixel(x, y, red, green, blue);
+}
+void FrameCanvas::GetPixels(int x, int y, int width, int height,
+                            uint8_t *rgb, int stride) const {
+  if (stride == 0) stride = 3 * width;
+  frame_->GetPixels(x, y, width, height, rgb, stride);
+}
+void FrameCanvas::GetImage(uint8_t *rgb, int stride) const {
+  GetPixels(0, 0, width(), height(), rgb, stride);
+}
 }  // end namespace rgb_matrix
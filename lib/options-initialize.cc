@@ -25,6 +25,7 @@
 
 #include <vector>
 
+#include "framebuffer-internal.h"
 #include "multiplex-mappers-internal.h"
 
 namespace rgb_matrix {
@@ -150,6 +151,11 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeStringFlag("pixel-mapper", it, end,
                             &mopts->pixel_mapper_config, &err))
         continue;
+      if (ConsumeStringFlag("gamma", it, end, &mopts->gamma, &err))
+        continue;
+      if (ConsumeStringFlag("white-balance", it, end,
+                            &mopts->white_balance, &err))
+        continue;
       if (ConsumeIntFlag("rows", it, end, &mopts->rows, &err))
         continue;
       if (ConsumeIntFlag("cols", it, end, &mopts->cols, &err))
@@ -172,6 +178,9 @@ static bool FlagInit(int &argc, char **&argv,
       if (ConsumeIntFlag("pwm-dither-bits", it, end,
                          &mopts->pwm_dither_bits, &err))
         continue;
+      if (ConsumeIntFlag("target-refresh", it, end,
+                         &mopts->target_refresh, &err))
+        continue;
       if (ConsumeIntFlag("row-addr-type", it, end,
                          &mopts->row_address_type, &err))
         continue;
@@ -179,6 +188,19 @@ static bool FlagInit(int &argc, char **&argv,
         continue;
       if (ConsumeBoolFlag("inverse", it, &mopts->inverse_colors))
         continue;
+      if (ConsumeBoolFlag("limit-pwm-storage", it, &mopts->limit_pwm_storage))
+        continue;
+      if (ConsumeBoolFlag("packed-bitplanes", it, &mopts->packed_bitplanes))
+        continue;
+      if (ConsumeBoolFlag("hardware-brightness", it,
+                          &mopts->hardware_brightness))
+        continue;
+      if (ConsumeBoolFlag("skip-blank-planes", it,
+                          &mopts->skip_blank_planes))
+        continue;
+      if (ConsumeBoolFlag("precompile-scanout", it,
+                          &mopts->precompile_scanout))
+        continue;
       // We don't have a swap_green_blue option anymore, but we simulate the
       // flag for a while.
       bool swap_green_blue;
@@ -383,9 +405,13 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "\t                            Available: %s. Default: \"\"\n"
           "\t--led-pwm-bits=<1..11>    : PWM bits (Default: %d).\n"
           "\t--led-brightness=<percent>: Brightness in percent (Default: %d).\n"
+          "\t--led-gamma=<g|r,g,b>     : Gamma per channel; 0 = CIE1931 "
+          "(Default: \"%s\").\n"
+          "\t--led-white-balance=<w|r,g,b>: Luminance scale per channel "
+          "0..1 (Default: \"%s\").\n"
           "\t--led-scan-mode=<0..1>    : 0 = progressive; 1 = interlaced "
           "(Default: %d).\n"
-          "\t--led-row-addr-type=<0..2>: 0 = default; 1 = AB-addressed panels; 2 = direct row select"
+          "\t--led-row-addr-type=<0..3>: 0 = default; 1 = AB-addressed panels; 2 = direct row select; 3 = ABC shift register"
           "(Default: 0).\n"
           "\t--led-%sshow-refresh        : %show refresh rate.\n"
           "\t--led-%sinverse             "
@@ -396,15 +422,35 @@ void PrintMatrixFlags(FILE *out, const RGBMatrix::Options &d,
           "(Default: %d)\n"
           "\t--led-pwm-dither-bits=<0..2> : Time dithering of lower bits "
           "(Default: 0)\n"
+          "\t--led-target-refresh=<Hz> : Lower pwm bits and dithering as "
+          "needed to keep this refresh rate (Default: 0 = off)\n"
+          "\t--led-%slimit-pwm-storage   : %snly allocate memory for "
+          "--led-pwm-bits bitplanes.\n"
+          "\t--led-%spacked-bitplanes    : %sse compact frame-buffer "
+          "representation.\n"
+          "\t--led-%shardware-brightness : %spply brightness by output "
+          "timing.\n"
+          "\t--led-%sskip-blank-planes   : %skip sending bitplanes that "
+          "are all off.\n"
+          "\t--led-%sprecompile-scanout  : %srecompute GPIO output of "
+          "frames on swap.\n"
           "\t--led-%shardware-pulse   : %sse hardware pin-pulse generation.\n",
           d.hardware_mapping,
           d.rows, d.cols, d.chain_length, d.parallel,
           (int) muxers.size(), CreateAvailableMultiplexString(muxers).c_str(),
           available_mappers.c_str(),
-          d.pwm_bits, d.brightness, d.scan_mode,
+          d.pwm_bits, d.brightness, d.gamma, d.white_balance, d.scan_mode,
           d.show_refresh_rate ? "no-" : "", d.show_refresh_rate ? "Don't s" : "S",
           d.inverse_colors ? "no-" : "",    d.inverse_colors ? "off" : "on",
           d.pwm_lsb_nanoseconds,
+          d.limit_pwm_storage ? "no-" : "", d.limit_pwm_storage ? "Don't o" : "O",
+          d.packed_bitplanes ? "no-" : "", d.packed_bitplanes ? "Don't u" : "U",
+          d.hardware_brightness ? "no-" : "",
+          d.hardware_brightness ? "Don't a" : "A",
+          d.skip_blank_planes ? "no-" : "",
+          d.skip_blank_planes ? "Don't s" : "S",
+          d.precompile_scanout ? "no-" : "",
+          d.precompile_scanout ? "Don't p" : "P",
           !d.disable_hardware_pulsing ? "no-" : "",
           !d.disable_hardware_pulsing ? "Don't u" : "U");
 
@@ -456,8 +502,8 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
-  if (row_address_type < 0 || row_address_type > 2) {
-    err->append("Row address type values can be 0 (default), 1 (AB addressing), 2 (direct row select)\n");
+  if (row_address_type < 0 || row_address_type > 3) {
+    err->append("Row address type values can be 0 (default), 1 (AB addressing), 2 (direct row select), 3 (ABC shift register)\n");
     success = false;
   }
 
@@ -471,6 +517,19 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  float color_scratch[3];
+  if (!internal::ParseColorCorrection(gamma, 0, 5, color_scratch)) {
+    err->append("Invalid gamma. Needs one value or three comma separated "
+                "values for red, green, blue in range 0..5.\n");
+    success = false;
+  }
+
+  if (!internal::ParseColorCorrection(white_balance, 0, 1, color_scratch)) {
+    err->append("Invalid white-balance. Needs one value or three comma "
+                "separated values for red, green, blue in range 0..1.\n");
+    success = false;
+  }
+
   if (pwm_bits <= 0 || pwm_bits > 11) {
     err->append("Invalid range of pwm-bits (1..11 allowed).\n");
     success = false;
@@ -491,6 +550,11 @@ bool RGBMatrix::Options::Validate(std::string *err_in) const {
     success = false;
   }
 
+  if (target_refresh < 0 || target_refresh > 10000) {
+    err->append("Invalid range of target-refresh (0..10000 Hz allowed).\n");
+    success = false;
+  }
+
   if (led_rgb_sequence == NULL || strlen(led_rgb_sequence) != 3) {
     err->append("led-sequence needs to be three characters long.\n");
     success = false;
@@ -0,0 +1,643 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Decode the GPIO signals the matrix generates back into the image a HUB75
+// panel would show.
+//
+// The matrix is run with a RecordingGPIOBackend, so this does not need any
+// hardware (and no root). The recorded CLK/STROBE/OE/address/color operations
+// are fed through a model of the panel shift registers and latches; every
+// output-enable pulse adds its length to the on-time of the LEDs latched in
+// the addressed row. From that we get
+//   - the perceived (linear) image, normalized to the full on-time of a row,
+//   - the on-time per row and the bit-planes (distinct pulse lengths) used,
+//   - the number of GPIO operations per frame and an estimate of the dark
+//     time they cause.
+// The signature printed at the end is a hash over the exact per-LED on-times,
+// so two builds (or two traces) can quickly be checked to produce exactly
+// the same output.
+//
+// The decoded image is in the coordinates of the panel shift registers, i.e.
+// without multiplexing or pixel mappers applied.
+
+#include "led-matrix.h"
+#include "gpio.h"
+#include "hardware-mapping.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RecordingGPIOBackend;
+
+typedef RecordingGPIOBackend::Event Event;
+
+static const char kTraceMagic[8] = { 'H', 'U', 'B', '7', '5', 'T', 'R', '1' };
+
+// Model of a chain of HUB75 panels: shift registers that are clocked on the
+// rising edge of CLK, latches that take over the shifted data on the rising
+// edge of STROBE and the row address lines (or the shift register driving
+// the rows, see --led-row-addr-type).
+class TraceDecoder {
+public:
+  TraceDecoder(const HardwareMapping &h, int parallel, int row_address_type,
+               int gpio_write_ns)
+    : h_(h), parallel_(parallel), row_address_type_(row_address_type),
+      gpio_write_ns_(gpio_write_ns),
+      row_shift_(0), row_latch_(0),
+      columns_(0), double_rows_(0), frames_(0), gpio_ops_(0),
+      dark_ns_(0), inconsistent_latches_(0) {
+    const gpio_bits_t lanes[3][6] = {
+      { h.p0_r1, h.p0_g1, h.p0_b1, h.p0_r2, h.p0_g2, h.p0_b2 },
+      { h.p1_r1, h.p1_g1, h.p1_b1, h.p1_r2, h.p1_g2, h.p1_b2 },
+      { h.p2_r1, h.p2_g1, h.p2_b1, h.p2_r2, h.p2_g2, h.p2_b2 },
+    };
+    memcpy(lanes_, lanes, sizeof(lanes_));
+  }
+
+  // Returns false if the trace did not contain a single full frame.
+  bool Decode(const std::vector<Event> &events);
+
+  int width() const { return columns_; }
+  int height() const { return 2 * double_rows_ * parallel_; }
+  int double_rows() const { return double_rows_; }
+  int frames() const { return frames_; }
+
+  // Average on-time of the LED per frame in nanoseconds.
+  double OnTime(int x, int y, int color) const {
+    return on_time_[(y * columns_ + x) * 3 + color] / (double) frames_;
+  }
+  // Average time the given double row is switched on per frame.
+  double RowOnTime(int row) const {
+    return row_on_time_[row] / (double) frames_;
+  }
+  // Like RowOnTime(), plus the time the row was kept dark on purpose
+  // instead (waits of shortened pulses or of skipped blank bit-planes).
+  double RowTime(int row) const {
+    return row_time_[row] / (double) frames_;
+  }
+  // Pulse lengths and how often they appeared per frame.
+  const std::map<uint32_t, uint64_t> &pulses() const { return pulses_; }
+  double GpioOpsPerFrame() const { return gpio_ops_ / (double) frames_; }
+  double DarkTimePerFrame() const { return dark_ns_ / (double) frames_; }
+  int inconsistent_latches() const { return inconsistent_latches_; }
+
+  // FNV-1a hash over the decoded on-times per frame. Independent of the
+  // number of frames as long as all frames are the same (no dithering).
+  uint64_t Signature() const;
+
+  bool WritePPM(const char *filename) const;
+
+private:
+  void ResetRowDriver();
+  void SetBits(gpio_bits_t before, gpio_bits_t bits);
+  int RowAddress(gpio_bits_t out) const;
+  void Pulse(gpio_bits_t out, uint32_t nanoseconds);
+  void FinishFrame();
+
+  const HardwareMapping h_;
+  const int parallel_;
+  const int row_address_type_;
+  const int gpio_write_ns_;
+  gpio_bits_t lanes_[3][6];
+
+  // Shift register row drivers. Bit 0 is the output of the last bit shifted
+  // in, so bit n selects row n.
+  uint64_t row_shift_;
+  uint64_t row_latch_;
+
+  int columns_;
+  int double_rows_;
+  int frames_;
+
+  // State of the current, not yet complete frame.
+  std::vector<gpio_bits_t> shifted_;  // Clocked in since last strobe.
+  std::vector<gpio_bits_t> latched_;
+  std::vector<uint64_t> frame_on_time_;
+  std::vector<uint64_t> frame_row_on_time_;
+  std::vector<uint64_t> frame_row_time_;
+  std::map<uint32_t, uint64_t> frame_pulses_;
+  uint64_t frame_gpio_ops_;
+  uint64_t frame_dark_ns_;
+
+  // Sum of all completed frames.
+  std::vector<uint64_t> on_time_;
+  std::vector<uint64_t> row_on_time_;
+  std::vector<uint64_t> row_time_;
+  std::map<uint32_t, uint64_t> pulses_;
+  uint64_t gpio_ops_;
+  uint64_t dark_ns_;
+
+  int inconsistent_latches_;
+};
+
+void TraceDecoder::ResetRowDriver() {
+  row_shift_ = row_latch_ = (row_address_type_ == 1) ? ~0ULL : 0;
+}
+
+// GPIO bits set while the output was "before".
+void TraceDecoder::SetBits(gpio_bits_t before, gpio_bits_t bits) {
+  switch (row_address_type_) {
+  case 1:
+    // A clocks in B. The outputs follow one clock behind, as if the latch
+    // clock is tied to the shift clock.
+    if ((bits & h_.a) && !(before & h_.a)) {
+      row_latch_ = row_shift_;
+      row_shift_ = (row_shift_ << 1) | ((before & h_.b) ? 1 : 0);
+    }
+    break;
+  case 3:  // A clocks in B, C latches.
+    if ((bits & h_.a) && !(before & h_.a))
+      row_shift_ = (row_shift_ << 1) | ((before & h_.b) ? 1 : 0);
+    if ((bits & h_.c) && !(before & h_.c))
+      row_latch_ = row_shift_;
+    break;
+  }
+}
+
+int TraceDecoder::RowAddress(gpio_bits_t out) const {
+  switch (row_address_type_) {
+  case 1:  // Low output selects the row.
+    return ~row_latch_ ? __builtin_ctzll(~row_latch_) : -1;
+  case 3:  // High output selects the row.
+    return row_latch_ ? __builtin_ctzll(row_latch_) : -1;
+  case 2:  // One line of ABCD low selects the row.
+    if (!(out & h_.a)) return 0;
+    if (!(out & h_.b)) return 1;
+    if (!(out & h_.c)) return 2;
+    if (!(out & h_.d)) return 3;
+    return -1;
+  default:  // Binary address on ABCDE.
+    return (((out & h_.a) ? 0x01 : 0) | ((out & h_.b) ? 0x02 : 0)
+            | ((out & h_.c) ? 0x04 : 0) | ((out & h_.d) ? 0x08 : 0)
+            | ((out & h_.e) ? 0x10 : 0));
+  }
+}
+
+void TraceDecoder::Pulse(gpio_bits_t out, uint32_t nanoseconds) {
+  const int row = RowAddress(out);
+  if (row < 0 || row >= double_rows_) return;
+  frame_row_on_time_[row] += nanoseconds;
+  frame_row_time_[row] += nanoseconds;
+  frame_pulses_[nanoseconds]++;
+  const int rows = 2 * double_rows_;
+  for (int p = 0; p < parallel_; ++p) {
+    for (int half = 0; half < 2; ++half) {
+      const int y = p * rows + half * double_rows_ + row;
+      uint64_t *on_time = &frame_on_time_[y * columns_ * 3];
+      const gpio_bits_t *lane = lanes_[p] + 3 * half;
+      for (int x = 0; x < columns_; ++x) {
+        for (int c = 0; c < 3; ++c) {
+          if (latched_[x] & lane[c]) on_time[3 * x + c] += nanoseconds;
+        }
+      }
+    }
+  }
+}
+
+void TraceDecoder::FinishFrame() {
+  for (size_t i = 0; i < on_time_.size(); ++i)
+    on_time_[i] += frame_on_time_[i];
+  for (size_t i = 0; i < row_on_time_.size(); ++i) {
+    row_on_time_[i] += frame_row_on_time_[i];
+    row_time_[i] += frame_row_time_[i];
+  }
+  for (std::map<uint32_t, uint64_t>::const_iterator it = frame_pulses_.begin();
+       it != frame_pulses_.end(); ++it) {
+    pulses_[it->first] += it->second;
+  }
+  gpio_ops_ += frame_gpio_ops_;
+  dark_ns_ += frame_dark_ns_;
+  ++frames_;
+}
+
+bool TraceDecoder::Decode(const std::vector<Event> &events) {
+  // First pass: geometry. The number of clocks between strobes is the
+  // length of the shift register, the largest address the number of rows.
+  gpio_bits_t out = 0;
+  int clocks = 0;
+  ResetRowDriver();
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event &e = events[i];
+    switch (e.type) {
+    case Event::SET:
+      SetBits(out, e.bits);
+      if ((e.bits & h_.clock) && !(out & h_.clock)) ++clocks;
+      if ((e.bits & h_.strobe) && !(out & h_.strobe)) {
+        if (clocks > columns_) columns_ = clocks;
+        clocks = 0;
+      }
+      out |= e.bits;
+      break;
+    case Event::CLEAR:
+      out &= ~e.bits;
+      break;
+    case Event::PULSE:
+    case Event::WAIT:
+      if (RowAddress(out) >= double_rows_) double_rows_ = RowAddress(out) + 1;
+      break;
+    }
+  }
+  if (columns_ == 0 || double_rows_ == 0)
+    return false;
+
+  const size_t pixels = (size_t) columns_ * height();
+  on_time_.assign(pixels * 3, 0);
+  row_on_time_.assign(double_rows_, 0);
+  row_time_.assign(double_rows_, 0);
+  gpio_ops_ = 0;
+  dark_ns_ = 0;
+  latched_.assign(columns_, 0);
+
+  // Second pass: decode. A frame starts with the first pulse or wait on row
+  // 0 after a different row (a row might only have dark waits for planes
+  // without any LED on); everything before the first and after the last
+  // frame start is partial and ignored.
+  bool in_frame = false;
+  int last_row = -1;
+  uint32_t last_pulse_ns = 0;
+  uint64_t shift_ops = 0;   // GPIO ops up to the last clock since last pulse.
+  uint64_t ops = 0;         // All GPIO ops since last pulse.
+  out = 0;
+  ResetRowDriver();
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event &e = events[i];
+    switch (e.type) {
+    case Event::SET:
+      SetBits(out, e.bits);
+      ++ops;
+      if ((e.bits & h_.clock) && !(out & h_.clock)) {
+        shifted_.push_back(out | e.bits);
+        shift_ops = ops;
+      }
+      if ((e.bits & h_.strobe) && !(out & h_.strobe)) {
+        if ((int) shifted_.size() != columns_) ++inconsistent_latches_;
+        // Columns are numbered in the order they are clocked in, the same
+        // as in the frame-buffer.
+        const int n = std::min<int>(shifted_.size(), columns_);
+        for (int x = 0; x < n; ++x) latched_[x] = shifted_[x];
+        shifted_.clear();
+      }
+      out |= e.bits;
+      break;
+
+    case Event::CLEAR:
+      ++ops;
+      out &= ~e.bits;
+      break;
+
+    case Event::PULSE:
+    case Event::WAIT: {
+      const int row = RowAddress(out);
+      if (row == 0 && last_row > 0) {
+        if (in_frame) FinishFrame();
+        in_frame = true;
+        frame_on_time_.assign(pixels * 3, 0);
+        frame_row_on_time_.assign(double_rows_, 0);
+        frame_row_time_.assign(double_rows_, 0);
+        frame_pulses_.clear();
+        frame_gpio_ops_ = 0;
+        frame_dark_ns_ = 0;
+      }
+      last_row = row;
+      if (e.type == Event::WAIT) {
+        // Dark on purpose, e.g. after a shortened pulse; the next data is
+        // clocked in meanwhile.
+        if (in_frame) {
+          frame_dark_ns_ += e.nanoseconds;
+          if (row >= 0 && row < double_rows_)
+            frame_row_time_[row] += e.nanoseconds;
+        }
+        last_pulse_ns += e.nanoseconds;
+        break;
+      }
+      if (in_frame) {
+        Pulse(out, e.nanoseconds);
+        frame_gpio_ops_ += ops;
+        // The data for the next pulse is clocked in while the previous one
+        // is still running; address and strobe only after it finished.
+        const int64_t shift_ns = shift_ops * gpio_write_ns_;
+        if (shift_ns > last_pulse_ns) frame_dark_ns_ += shift_ns - last_pulse_ns;
+        frame_dark_ns_ += (ops - shift_ops) * gpio_write_ns_;
+      }
+      last_pulse_ns = e.nanoseconds;
+      ops = shift_ops = 0;
+      break;
+    }
+    }
+  }
+  return frames_ > 0;
+}
+
+uint64_t TraceDecoder::Signature() const {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < on_time_.size(); ++i) {
+    const uint64_t on_time = on_time_[i] / frames_;
+    for (int b = 0; b < 64; b += 8) {
+      hash ^= (on_time >> b) & 0xff;
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
+
+bool TraceDecoder::WritePPM(const char *filename) const {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width(), height());
+  const int rows = 2 * double_rows_;
+  for (int y = 0; y < height(); ++y) {
+    const double full = RowTime(y % rows % double_rows_);
+    for (int x = 0; x < width(); ++x) {
+      for (int c = 0; c < 3; ++c) {
+        const double v = full > 0 ? OnTime(x, y, c) / full : 0;
+        fputc((int) round(255 * v), f);
+      }
+    }
+  }
+  return fclose(f) == 0;
+}
+
+static bool WriteTrace(const char *filename, const std::vector<Event> &events) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  fwrite(kTraceMagic, sizeof(kTraceMagic), 1, f);
+  for (size_t i = 0; i < events.size(); ++i) {
+    const uint32_t record[3] = { (uint32_t) events[i].type, events[i].bits,
+                                 events[i].nanoseconds };
+    fwrite(record, sizeof(record), 1, f);
+  }
+  return fclose(f) == 0;
+}
+
+static bool ReadTrace(const char *filename, std::vector<Event> *events) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  char magic[sizeof(kTraceMagic)];
+  if (fread(magic, sizeof(magic), 1, f) != 1
+      || memcmp(magic, kTraceMagic, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s: not a trace file.\n", filename);
+    fclose(f);
+    return false;
+  }
+  uint32_t record[3];
+  while (fread(record, sizeof(record), 1, f) == 1) {
+    const Event e = { (Event::Type) record[0], record[1], record[2] };
+    events->push_back(e);
+  }
+  fclose(f);
+  return true;
+}
+
+// Recorder that also sleeps for the length of each output-enable pulse, as
+// the refresh thread would on real hardware. Otherwise the realtime thread
+// spins through frames and starves the main thread on single-core machines.
+class PacedRecorder : public RecordingGPIOBackend {
+public:
+  virtual void Pulse(uint32_t bits, long nanoseconds) {
+    RecordingGPIOBackend::Pulse(bits, nanoseconds);
+    const struct timespec sleep_time = { 0, nanoseconds };
+    nanosleep(&sleep_time, NULL);
+  }
+  virtual void Wait(long nanoseconds) {
+    RecordingGPIOBackend::Wait(nanoseconds);
+    const struct timespec sleep_time = { 0, nanoseconds };
+    nanosleep(&sleep_time, NULL);
+  }
+};
+
+// Reads a binary PPM (P6) image with a maxval of 255.
+static bool ReadPPM(const char *filename, int *width, int *height,
+                    std::vector<uint8_t> *rgb) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  int values[3];
+  bool ok = (fgetc(f) == 'P' && fgetc(f) == '6');
+  for (int i = 0; ok && i < 3; ++i) {
+    int c;
+    while ((c = fgetc(f)) == '#' || isspace(c)) {
+      if (c == '#') while ((c = fgetc(f)) != '\n' && c != EOF) {}
+    }
+    ungetc(c, f);
+    ok = (fscanf(f, "%d", &values[i]) == 1);
+  }
+  ok = ok && values[2] == 255 && isspace(fgetc(f));
+  if (ok) {
+    *width = values[0];
+    *height = values[1];
+    rgb->resize(3 * values[0] * values[1]);
+    ok = fread(&(*rgb)[0], rgb->size(), 1, f) == 1;
+  }
+  fclose(f);
+  if (!ok) fprintf(stderr, "%s: Can't read as binary 8-bit PPM.\n", filename);
+  return ok;
+}
+
+static bool CaptureTrace(const RGBMatrix::Options &options,
+                         const char *image_file, int frames,
+                         std::vector<Event> *events) {
+  int img_width = 0, img_height = 0;
+  std::vector<uint8_t> image;
+  if (image_file && !ReadPPM(image_file, &img_width, &img_height, &image))
+    return false;
+
+  PacedRecorder backend;
+  GPIO io;
+  io.Init(&backend);
+
+  RGBMatrix *matrix = new RGBMatrix(NULL, options);
+  matrix->SetGPIO(&io, true);
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (image_file) {
+        if (x < img_width && y < img_height) {
+          const uint8_t *p = &image[3 * (y * img_width + x)];
+          canvas->SetPixel(x, y, p[0], p[1], p[2]);
+        }
+      } else {
+        // Test pattern: gradients in red and green, a checkerboard in blue.
+        canvas->SetPixel(x, y, 255 * x / width, 255 * y / height,
+                         ((x ^ y) & 1) ? 255 : 0);
+      }
+    }
+  }
+  // A second canvas with the same content, so that we can wait for frames
+  // by swapping back and forth without changing what is shown.
+  FrameCanvas *other = matrix->CreateFrameCanvas();
+  other->CopyFrom(*canvas);
+  canvas = matrix->SwapOnVSync(canvas);
+
+  // Once the swap returns, the refresh only shows our image. Each further
+  // swap waits for one more frame; we need one more frame start than full
+  // frames, the decoder discards the partial ones.
+  backend.TakeEvents(events);
+  events->clear();
+  size_t dropped = 0;
+  std::vector<Event> chunk;
+  for (int f = 0; f <= frames; ++f) {
+    other = matrix->SwapOnVSync(other);
+    dropped += backend.TakeEvents(&chunk);
+    events->insert(events->end(), chunk.begin(), chunk.end());
+  }
+  delete matrix;
+  if (dropped > 0) {
+    fprintf(stderr, "Recording dropped %zu GPIO operations.\n", dropped);
+  }
+  return true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-i <ppm>      : Image to show (binary PPM). "
+          "Default: test pattern.\n"
+          "\t-f <frames>   : Number of frames to capture (Default: 4).\n"
+          "\t-w <trace>    : Write captured GPIO trace to file.\n"
+          "\t-r <trace>    : Decode trace file instead of capturing.\n"
+          "\t-o <ppm>      : Write perceived image to PPM file.\n"
+          "\t-W <ns>       : Time per GPIO write in nanoseconds to estimate "
+          "dark time (Default: 0 = off).\n"
+          "\t-v            : Verbose: print on-time per row.\n\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv, &matrix_options, NULL)) {
+    return usage(argv[0]);
+  }
+
+  const char *image_file = NULL;
+  const char *write_trace = NULL;
+  const char *read_trace = NULL;
+  const char *output_image = NULL;
+  int frames = 4;
+  int gpio_write_ns = 0;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:f:w:r:o:W:v")) != -1) {
+    switch (opt) {
+    case 'i': image_file = optarg; break;
+    case 'f': frames = atoi(optarg); break;
+    case 'w': write_trace = optarg; break;
+    case 'r': read_trace = optarg; break;
+    case 'o': output_image = optarg; break;
+    case 'W': gpio_write_ns = atoi(optarg); break;
+    case 'v': verbose = true; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (frames <= 0 || gpio_write_ns < 0) return usage(argv[0]);
+
+  std::string err;
+  if (!matrix_options.Validate(&err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return 1;
+  }
+  std::vector<Event> events;
+  if (read_trace) {
+    if (!ReadTrace(read_trace, &events)) return 1;
+  } else {
+    if (!CaptureTrace(matrix_options, image_file, frames, &events)) return 1;
+    if (write_trace && !WriteTrace(write_trace, events)) return 1;
+  }
+
+  const char *mapping_name = matrix_options.hardware_mapping;
+  if (mapping_name == NULL || *mapping_name == '\0') mapping_name = "regular";
+  const HardwareMapping *mapping = NULL;
+  for (const HardwareMapping *it = matrix_hardware_mappings; it->name; ++it) {
+    if (strcasecmp(it->name, mapping_name) == 0) {
+      mapping = it;
+      break;
+    }
+  }
+  if (mapping == NULL) {
+    fprintf(stderr, "There is no hardware mapping named '%s'.\n",
+            mapping_name);
+    return 1;
+  }
+
+  TraceDecoder decoder(*mapping, matrix_options.parallel,
+                       matrix_options.row_address_type, gpio_write_ns);
+  if (!decoder.Decode(events)) {
+    fprintf(stderr, "Trace does not contain a full frame.\n");
+    return 1;
+  }
+
+  printf("Decoded %d frame%s of %dx%d (%d double rows) from %zu GPIO "
+         "operations.\n", decoder.frames(), decoder.frames() == 1 ? "" : "s",
+         decoder.width(), decoder.height(), decoder.double_rows(),
+         events.size());
+  if (decoder.inconsistent_latches()) {
+    printf("WARNING: %d latches with unexpected number of clocks.\n",
+           decoder.inconsistent_latches());
+  }
+
+  double total_on = 0, min_on = -1, max_on = 0;
+  double total_time = 0, min_time = -1, max_time = 0;
+  for (int r = 0; r < decoder.double_rows(); ++r) {
+    const double on = decoder.RowOnTime(r);
+    total_on += on;
+    if (min_on < 0 || on < min_on) min_on = on;
+    if (on > max_on) max_on = on;
+    const double time = decoder.RowTime(r);
+    total_time += time;
+    if (min_time < 0 || time < min_time) min_time = time;
+    if (time > max_time) max_time = time;
+    if (verbose) printf("  row %2d: %10.0fns on, %10.0fns with dark waits\n",
+                        r, on, time);
+  }
+  printf("Row on-time per frame: %.0fns..%.0fns, total %.0fns\n",
+         min_on, max_on, total_on);
+  if (total_time > total_on) {
+    printf("Row time with dark waits: %.0fns..%.0fns, total %.0fns\n",
+           min_time, max_time, total_time);
+  }
+
+  const std::map<uint32_t, uint64_t> &pulses = decoder.pulses();
+  const uint32_t shortest = pulses.begin()->first;
+  printf("Bit-planes: %zu pulse lengths, %uns..%uns; "
+         "effective color depth %.1f bits\n",
+         pulses.size(), shortest, pulses.rbegin()->first,
+         log2(max_on / shortest + 1));
+
+  printf("GPIO operations per frame: %.0f\n", decoder.GpioOpsPerFrame());
+  if (gpio_write_ns > 0) {
+    const double dark = decoder.DarkTimePerFrame();
+    printf("Dark time per frame: %.0fns (%.1f%% of frame)\n",
+           dark, 100.0 * dark / (dark + total_on));
+  }
+  printf("Signature: %016llx\n", (unsigned long long) decoder.Signature());
+
+  if (output_image && !decoder.WritePPM(output_image)) return 1;
+  return 0;
+}
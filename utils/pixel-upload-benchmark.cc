@@ -0,0 +1,102 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Benchmark how fast full frames can be uploaded to a FrameCanvas: pixel by
+// pixel with SetPixel() vs. the bulk SetImage().
+//
+// This does not need any hardware (and no root), the matrix is created
+// without GPIO, so it can run on any machine. It accepts the usual --led-*
+// flags to benchmark the configuration (chain, parallel, pixel mappers...)
+// you are interested in.
+
+#include "led-matrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::RGBMatrix;
+
+static double GetTimeInSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-n<frames>    : Number of frames to upload per run "
+          "(Default: 200).\n\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv, &matrix_options, NULL)) {
+    return usage(argv[0]);
+  }
+
+  int frames = 200;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+    case 'n': frames = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (frames <= 0) return usage(argv[0]);
+
+  std::string err;
+  if (!matrix_options.Validate(&err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return 1;
+  }
+
+  // No GPIO: we only exercise the frame-buffer.
+  RGBMatrix *matrix = new RGBMatrix(NULL, matrix_options);
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+
+  // A couple of different images to not just measure the cache.
+  const int kImages = 4;
+  std::vector<uint8_t> images[kImages];
+  srand(42);
+  for (int i = 0; i < kImages; ++i) {
+    images[i].resize(width * height * 3);
+    for (size_t p = 0; p < images[i].size(); ++p) images[i][p] = rand();
+  }
+
+  double start = GetTimeInSeconds();
+  for (int f = 0; f < frames; ++f) {
+    const uint8_t *pixel = &images[f % kImages][0];
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x, pixel += 3) {
+        canvas->SetPixel(x, y, pixel[0], pixel[1], pixel[2]);
+      }
+    }
+  }
+  const double per_pixel_time = (GetTimeInSeconds() - start) / frames;
+
+  start = GetTimeInSeconds();
+  for (int f = 0; f < frames; ++f) {
+    canvas->SetImage(&images[f % kImages][0]);
+  }
+  const double bulk_time = (GetTimeInSeconds() - start) / frames;
+
+  printf("%dx%d pixels, pwm-bits=%d, %d frames\n",
+         width, height, canvas->pwmbits(), frames);
+  printf("SetPixel() : %8.1f usec/frame\n", per_pixel_time * 1e6);
+  printf("SetImage() : %8.1f usec/frame (%.1fx)\n", bulk_time * 1e6,
+         per_pixel_time / bulk_time);
+
+  delete matrix;
+  return 0;
+}
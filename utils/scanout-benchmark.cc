@@ -0,0 +1,156 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Benchmark the CPU time the refresh needs to send a frame to the panels:
+// clocking in the bit-planes and switching rows, i.e. the time the LEDs are
+// dark. The output-enable pulses don't take any time here, so the refresh
+// runs as fast as it can.
+//
+// Like the hub75-trace-decoder, this does not need any hardware (and no
+// root): all GPIO operations go to a backend that drops them. It accepts the
+// usual --led-* flags, so run it once per configuration of interest, e.g.
+// different --led-parallel, --led-scan-mode, --led-row-addr-type,
+// --led-packed-bitplanes or --led-precompile-scanout.
+//
+// Each GPIO operation costs a virtual function call to the backend, so the
+// numbers are not what the same machine would do with real GPIO; they are
+// meant to compare configurations and builds with each other.
+
+#include "led-matrix.h"
+#include "gpio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RefreshTiming;
+
+// Only counts the operations and the output-enable pulses, one per plane
+// sent.
+class CountingGPIOBackend : public rgb_matrix::GPIOBackend {
+public:
+  CountingGPIOBackend() : operations_(0), pulses_(0) {}
+
+  virtual void SetBits(uint32_t value) { ++operations_; }
+  virtual void ClearBits(uint32_t value) { ++operations_; }
+  virtual uint32_t Read() { return 0; }
+  virtual void Pulse(uint32_t bits, long nanoseconds) {
+    operations_ += 2;
+    ++pulses_;
+  }
+
+  // Not synchronized with the refresh thread; good enough for statistics.
+  uint64_t operations() const { return operations_; }
+  uint64_t pulses() const { return pulses_; }
+
+private:
+  volatile uint64_t operations_;
+  volatile uint64_t pulses_;
+};
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-s <seconds>  : Time to measure (Default: 2).\n\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv, &matrix_options, NULL)) {
+    return usage(argv[0]);
+  }
+
+  int seconds = 2;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    switch (opt) {
+    case 's': seconds = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (seconds <= 0) return usage(argv[0]);
+
+  std::string err;
+  if (!matrix_options.Validate(&err)) {
+    fprintf(stderr, "%s", err.c_str());
+    return 1;
+  }
+
+  CountingGPIOBackend backend;
+  GPIO io;
+  io.Init(&backend);
+
+  RGBMatrix *matrix = new RGBMatrix(NULL, matrix_options);
+  FrameCanvas *canvas = matrix->CreateFrameCanvas();
+  const int width = canvas->width();
+  const int height = canvas->height();
+
+  // Random pixels, so that no bit-plane is empty.
+  std::vector<uint8_t> image(width * height * 3);
+  srand(42);
+  for (size_t p = 0; p < image.size(); ++p) image[p] = rand();
+  canvas->SetImage(&image[0]);
+
+  matrix->SetGPIO(&io, true);
+  matrix->SwapOnVSync(canvas);
+  matrix->EnableRefreshTiming(true);
+
+  // The refresh thread runs with realtime priority, so when we get to read
+  // the counters it might have sent quite a few more frames. So the
+  // operations are only related to the planes sent, not to the frames.
+  RefreshTiming start, end;
+  if (!matrix->GetRefreshTiming(&start)) {
+    fprintf(stderr, "Refresh is not running.\n");
+    delete matrix;
+    return 1;
+  }
+  const uint64_t start_operations = backend.operations();
+  const uint64_t start_pulses = backend.pulses();
+  sleep(seconds);
+  matrix->GetRefreshTiming(&end);
+  const uint64_t operations = backend.operations() - start_operations;
+  const uint64_t pulses = backend.pulses() - start_pulses;
+  delete matrix;
+
+  const uint64_t frames = end.frames - start.frames;
+  if (frames == 0 || pulses == 0) {
+    fprintf(stderr, "No frames measured.\n");
+    return 1;
+  }
+  const double clock_in = (end.PhaseTotal(RefreshTiming::CLOCK_IN)
+                           - start.PhaseTotal(RefreshTiming::CLOCK_IN))
+    / 1000.0 / frames;
+  const double row_select = (end.PhaseTotal(RefreshTiming::ROW_SELECT)
+                             - start.PhaseTotal(RefreshTiming::ROW_SELECT))
+    / 1000.0 / frames;
+  uint64_t planes_sent = 0;
+  for (int row = 0; row < end.double_rows; ++row) {
+    for (int b = 0; b < RefreshTiming::kBitPlanes; ++b) {
+      planes_sent += end.samples[row][b] - start.samples[row][b];
+    }
+  }
+
+  printf("%dx%d, parallel=%d, scan-mode=%d, row-addr-type=%d%s%s\n",
+         width, height, matrix_options.parallel, matrix_options.scan_mode,
+         matrix_options.row_address_type,
+         matrix_options.packed_bitplanes ? ", packed" : "",
+         matrix_options.precompile_scanout ? ", precompiled" : "");
+  printf("%llu frames, %.0f GPIO operations per frame (approx.)\n",
+         (unsigned long long) frames,
+         (double) operations / pulses * planes_sent / frames);
+  // All parallel chains are clocked in at the same time.
+  const int columns = matrix_options.cols * matrix_options.chain_length;
+  printf("Clock in:   %8.1fus per frame, %6.1fns per column\n",
+         clock_in, 1000.0 * clock_in * frames / planes_sent / columns);
+  printf("Row select: %8.1fus per frame\n", row_select);
+  printf("Total:      %8.1fus per frame\n", clock_in + row_select);
+  return 0;
+}